@@ -0,0 +1,147 @@
+#include "align.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+// The first multiple of step at or after t.
+int64_t tick_at_or_after (int64_t t, int64_t step) {
+    int64_t q = t / step;
+    if (q * step < t)
+	++q;
+    return q * step;
+}
+
+} // namespace
+
+align_method parse_align_method (const std::string& s) {
+    if (s == "last")
+	return align_last;
+    if (s == "linear")
+	return align_linear;
+    if (s == "mean")
+	return align_mean;
+    throw std::runtime_error ("unknown alignment: " + s);
+}
+
+aligner::aligner (std::vector<column> columns, std::chrono::nanoseconds step, std::chrono::nanoseconds lag,
+    align_method method, row_handler emit):
+    cols (std::move (columns)),
+    step (step.count ()),
+    lag (lag.count ()),
+    method (method),
+    handler (std::move (emit)),
+    states (cols.size ()),
+    values (cols.size ()),
+    flags (cols.size ())
+{
+    if (this->step <= 0)
+	throw std::runtime_error ("alignment step must be positive");
+    if (cols.empty ())
+	throw std::runtime_error ("nothing to align");
+}
+
+void aligner::push (const sample& s) {
+    auto i = std::find (cols.begin (), cols.end (), column (s.device, s.channel));
+    if (i == cols.end ())
+	return;
+    state& c = states[i - cols.begin ()];
+    if (c.has_prev && s.time < c.prev.time)
+	return;
+
+    if (!started) {
+	started = true;
+	next_row = tick_at_or_after (s.time, step);
+	for (state& st: states)
+	    st.next = next_row;
+    }
+    if (c.next < next_row) {
+	// those ticks went out without this column
+	c.next = next_row;
+	c.sum = c.count = 0;
+    }
+    resolve (c, s);
+    c.prev = s;
+    c.has_prev = true;
+    watermark = std::max (watermark, s.time);
+    emit (false);
+}
+
+void aligner::flush () {
+    emit (true);
+}
+
+void aligner::resolve (state& c, const sample& s) {
+    if (method == align_mean) {
+	for (; c.next < s.time; c.next += step) {
+	    resolved r {c.next, 0, sample_invalid};
+	    if (c.count)
+		r = resolved {c.next, int32_t (std::llround (double (c.sum) / c.count)), 0};
+	    c.ready.push_back (r);
+	    c.sum = c.count = 0;
+	}
+	if (!(s.flags & sample_invalid)) {
+	    c.sum += s.value;
+	    ++c.count;
+	}
+	return;
+    }
+
+    for (; c.next <= s.time; c.next += step) {
+	resolved r {c.next, 0, sample_invalid};
+	if (c.next == s.time)
+	    r = resolved {c.next, s.value, s.flags};
+	else if (c.has_prev && method == align_last)
+	    r = resolved {c.next, c.prev.value, c.prev.flags};
+	else if (c.has_prev) {
+	    double f = double (c.next - c.prev.time) / double (s.time - c.prev.time);
+	    int32_t v = int32_t (std::llround (c.prev.value + (double (s.value) - c.prev.value) * f));
+	    r = resolved {c.next, v, uint8_t (c.prev.flags | s.flags)};
+	}
+	c.ready.push_back (r);
+    }
+}
+
+// Tick t for a column that has not resolved it, with what it has so far.
+aligner::resolved aligner::force (state& c, int64_t t) {
+    if (c.next < t)
+	c.sum = c.count = 0;
+    resolved r {t, 0, sample_invalid};
+    if (method == align_mean) {
+	if (c.count)
+	    r = resolved {t, int32_t (std::llround (double (c.sum) / c.count)), 0};
+	c.sum = c.count = 0;
+    } else if (c.has_prev) {
+	r = resolved {t, c.prev.value, c.prev.flags};
+    }
+    c.next = t + step;
+    return r;
+}
+
+void aligner::emit (bool all) {
+    while (started) {
+	int64_t t = next_row;
+	bool complete = std::all_of (states.begin (), states.end (),
+	    [] (const state& c) { return !c.ready.empty (); });
+	if (!complete && (all ? t > watermark : watermark - t < lag))
+	    return;
+	for (size_t i = 0; i < states.size (); ++i) {
+	    state& c = states[i];
+	    resolved r;
+	    if (!c.ready.empty ()) {
+		r = c.ready.front ();
+		c.ready.pop_front ();
+	    } else {
+		r = force (c, t);
+	    }
+	    values[i] = r.value;
+	    flags[i] = r.flags;
+	}
+	handler (t, values.data (), flags.data ());
+	next_row += step;
+    }
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,91 @@
+#ifndef TEMPER_ALIGN_H
+#define TEMPER_ALIGN_H
+
+// Resampling of several sample streams onto one time grid.
+//
+// Grid ticks fall on multiples of step since the epoch. Each column, one
+// device and channel, gets a value at every tick:
+//
+//   align_last     the latest reading at or before the tick
+//   align_linear   interpolated between the readings either side of it
+//   align_mean     the mean of the readings in (tick - step, tick]
+//
+// Ticks are resolved per column as its readings arrive, and a row goes
+// out once every column has resolved it, or once some column is lag past
+// it; a column that has nothing for the tick by then is marked
+// sample_invalid. Only the last reading and the ticks not yet emitted are
+// kept per column, so memory does not grow with the history.
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "sample.h"
+
+enum align_method {
+    align_last,
+    align_linear,
+    align_mean
+};
+
+align_method parse_align_method (const std::string& s);
+
+class aligner {
+public:
+    typedef std::pair<uint16_t, uint8_t> column;        // device, channel
+
+    // Called once per tick, in order, with one value and flags per column.
+    // The arrays are reused.
+    typedef std::function<void (int64_t time, const int32_t* values, const uint8_t* flags)> row_handler;
+
+    aligner (std::vector<column> columns, std::chrono::nanoseconds step, std::chrono::nanoseconds lag,
+	align_method method, row_handler emit);
+
+    // Readings for other columns, and readings older than the last one of
+    // their column, are ignored.
+    void push (const sample& s);
+
+    // Emits every tick up to the latest reading, resolving what it must.
+    void flush ();
+
+private:
+    struct resolved {
+	int64_t time;
+	int32_t value;
+	uint8_t flags;
+    };
+
+    struct state {
+	bool has_prev = false;
+	sample prev;
+	int64_t next = 0;               // first tick not yet resolved
+	int64_t sum = 0;                // the open bucket, for align_mean
+	uint32_t count = 0;
+	std::deque<resolved> ready;
+    };
+
+    void resolve (state& c, const sample& s);
+    resolved force (state& c, int64_t t);
+    void emit (bool all);
+
+    std::vector<column> cols;
+    int64_t step;
+    int64_t lag;
+    align_method method;
+    row_handler handler;
+
+    std::vector<state> states;
+    bool started = false;
+    int64_t next_row = 0;               // next tick to emit
+    int64_t watermark = 0;              // latest reading of any column
+    std::vector<int32_t> values;
+    std::vector<uint8_t> flags;
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,266 @@
+#include "decode.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "sample.h"
+
+#if defined (__x86_64__) || (defined (__i386__) && defined (__SSE2__))
+#define TEMPER_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Every kernel evaluates the same float expressions in the same order, so
+// the vector paths agree with the scalar one to the bit.
+
+const int32_t temper_min = -55 * 256, temper_max = 125 * 256;
+
+// reading = word * k + o, in degrees or millidegrees
+struct temper_coeffs {
+    float k, o;
+
+    temper_coeffs (const calibration& cal, float unit):
+	k (cal.gain * unit / 256),
+	o (cal.offset * unit)
+    {}
+};
+
+inline void store (float* out, float v) { *out = v; }
+inline void store (int32_t* out, float v) { *out = std::lrint (v); }
+
+template <typename T>
+void temper_scalar (const uint8_t* raw, size_t n, const temper_coeffs& c, T* out, uint8_t* flags) {
+    for (size_t i = 0; i < n; ++i) {
+	int32_t w = int16_t ((raw[2 * i] << 8) | raw[2 * i + 1]);
+	store (&out[i], float (w) * c.k + c.o);
+	if (flags)
+	    flags[i] = w == -1 || w < temper_min || w > temper_max ? sample_invalid : 0;
+    }
+}
+
+struct sht1x_coeffs {
+    calibration t, h;
+    float unit = 1000;
+};
+
+inline bool sht1x_point (uint16_t so_t, uint16_t so_rh, const sht1x_coeffs& c, float& t_out, float& h_out) {
+    float st = so_t, srh = so_rh;
+    float t = st * 0.01f - 39.7f;
+    float rhl = (-2.0468f + 0.0367f * srh) + -1.5955e-6f * (srh * srh);
+    float rh = (t - 25.0f) * (0.01f + 0.00008f * srh) + rhl;
+    float tc = t * c.t.gain + c.t.offset;
+    float hc = rh * c.h.gain + c.h.offset;
+    float clamped = std::min (std::max (hc, 0.0f), 100.0f);
+    t_out = tc * c.unit;
+    h_out = clamped * c.unit;
+    return so_t > 0x3fff || so_rh > 0x0fff || hc < 0.0f || hc > 100.0f;
+}
+
+void sht1x_scalar (const uint16_t* temp, const uint16_t* humidity, size_t n, const sht1x_coeffs& c,
+    int32_t* t_out, int32_t* h_out, uint8_t* flags)
+{
+    for (size_t i = 0; i < n; ++i) {
+	float t, h;
+	bool bad = sht1x_point (temp[i], humidity[i], c, t, h);
+	t_out[i] = std::lrint (t);
+	h_out[i] = std::lrint (h);
+	if (flags)
+	    flags[i] = bad ? sample_invalid : 0;
+    }
+}
+
+#ifdef TEMPER_X86
+
+inline void store4 (float* out, __m128 v) { _mm_storeu_ps (out, v); }
+inline void store4 (int32_t* out, __m128 v) { _mm_storeu_si128 (reinterpret_cast<__m128i*> (out), _mm_cvtps_epi32 (v)); }
+
+inline void set_flags (uint8_t* flags, int mask, int lanes) {
+    for (int j = 0; j < lanes; ++j)
+	flags[j] = (mask >> j) & 1 ? sample_invalid : 0;
+}
+
+// four sign-extended words' worth of invalid lanes
+inline int temper_invalid4 (__m128i w) {
+    __m128i bad = _mm_or_si128 (_mm_cmpeq_epi32 (w, _mm_set1_epi32 (-1)),
+	_mm_or_si128 (_mm_cmplt_epi32 (w, _mm_set1_epi32 (temper_min)),
+	    _mm_cmpgt_epi32 (w, _mm_set1_epi32 (temper_max))));
+    return _mm_movemask_ps (_mm_castsi128_ps (bad));
+}
+
+// eight byte pairs per iteration
+template <typename T>
+size_t temper_sse2 (const uint8_t* raw, size_t n, const temper_coeffs& c, T* out, uint8_t* flags) {
+    const __m128 k = _mm_set1_ps (c.k), o = _mm_set1_ps (c.o);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+	__m128i b = _mm_loadu_si128 (reinterpret_cast<const __m128i*> (raw + 2 * i));
+	__m128i w = _mm_or_si128 (_mm_slli_epi16 (b, 8), _mm_srli_epi16 (b, 8));
+	__m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (w, w), 16);
+	__m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (w, w), 16);
+	store4 (out + i, _mm_add_ps (_mm_mul_ps (_mm_cvtepi32_ps (lo), k), o));
+	store4 (out + i + 4, _mm_add_ps (_mm_mul_ps (_mm_cvtepi32_ps (hi), k), o));
+	if (flags)
+	    set_flags (flags + i, temper_invalid4 (lo) | temper_invalid4 (hi) << 4, 8);
+    }
+    return i;
+}
+
+__attribute__ ((target ("avx2")))
+inline void store8 (float* out, __m256 v) { _mm256_storeu_ps (out, v); }
+
+__attribute__ ((target ("avx2")))
+inline void store8 (int32_t* out, __m256 v) {
+    _mm256_storeu_si256 (reinterpret_cast<__m256i*> (out), _mm256_cvtps_epi32 (v));
+}
+
+// sixteen byte pairs per iteration
+template <typename T>
+__attribute__ ((target ("avx2")))
+size_t temper_avx2 (const uint8_t* raw, size_t n, const temper_coeffs& c, T* out, uint8_t* flags) {
+    const __m256 k = _mm256_set1_ps (c.k), o = _mm256_set1_ps (c.o);
+    const __m256i idle = _mm256_set1_epi32 (-1);
+    const __m256i lo_limit = _mm256_set1_epi32 (temper_min), hi_limit = _mm256_set1_epi32 (temper_max);
+    const __m256i swap = _mm256_setr_epi8 (
+	1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+	1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+	__m256i w = _mm256_shuffle_epi8 (
+	    _mm256_loadu_si256 (reinterpret_cast<const __m256i*> (raw + 2 * i)), swap);
+	for (int half = 0; half < 2; ++half) {
+	    __m256i v = _mm256_cvtepi16_epi32 (half ? _mm256_extracti128_si256 (w, 1) : _mm256_castsi256_si128 (w));
+	    store8 (out + i + 8 * half, _mm256_add_ps (_mm256_mul_ps (_mm256_cvtepi32_ps (v), k), o));
+	    if (flags) {
+		__m256i bad = _mm256_or_si256 (_mm256_cmpeq_epi32 (v, idle),
+		    _mm256_or_si256 (_mm256_cmpgt_epi32 (lo_limit, v), _mm256_cmpgt_epi32 (v, hi_limit)));
+		set_flags (flags + i + 8 * half, _mm256_movemask_ps (_mm256_castsi256_ps (bad)), 8);
+	    }
+	}
+    }
+    return i;
+}
+
+// four readings per iteration
+size_t sht1x_sse2 (const uint16_t* temp, const uint16_t* humidity, size_t n, const sht1x_coeffs& c,
+    int32_t* t_out, int32_t* h_out, uint8_t* flags)
+{
+    const __m128 zero = _mm_setzero_ps (), hundred = _mm_set1_ps (100.0f), unit = _mm_set1_ps (c.unit);
+    const __m128i t_limit = _mm_set1_epi32 (0x3fff), h_limit = _mm_set1_epi32 (0x0fff);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+	__m128i ti = _mm_unpacklo_epi16 (_mm_loadl_epi64 (reinterpret_cast<const __m128i*> (temp + i)), _mm_setzero_si128 ());
+	__m128i hi = _mm_unpacklo_epi16 (_mm_loadl_epi64 (reinterpret_cast<const __m128i*> (humidity + i)), _mm_setzero_si128 ());
+	__m128 st = _mm_cvtepi32_ps (ti), srh = _mm_cvtepi32_ps (hi);
+	__m128 t = _mm_sub_ps (_mm_mul_ps (st, _mm_set1_ps (0.01f)), _mm_set1_ps (39.7f));
+	__m128 rhl = _mm_add_ps (_mm_add_ps (_mm_set1_ps (-2.0468f), _mm_mul_ps (_mm_set1_ps (0.0367f), srh)),
+	    _mm_mul_ps (_mm_set1_ps (-1.5955e-6f), _mm_mul_ps (srh, srh)));
+	__m128 rh = _mm_add_ps (_mm_mul_ps (_mm_sub_ps (t, _mm_set1_ps (25.0f)),
+	    _mm_add_ps (_mm_set1_ps (0.01f), _mm_mul_ps (_mm_set1_ps (0.00008f), srh))), rhl);
+	__m128 tc = _mm_add_ps (_mm_mul_ps (t, _mm_set1_ps (c.t.gain)), _mm_set1_ps (c.t.offset));
+	__m128 hc = _mm_add_ps (_mm_mul_ps (rh, _mm_set1_ps (c.h.gain)), _mm_set1_ps (c.h.offset));
+	__m128 clamped = _mm_min_ps (_mm_max_ps (hc, zero), hundred);
+	store4 (t_out + i, _mm_mul_ps (tc, unit));
+	store4 (h_out + i, _mm_mul_ps (clamped, unit));
+	if (flags) {
+	    __m128 bad = _mm_or_ps (_mm_or_ps (_mm_cmplt_ps (hc, zero), _mm_cmpgt_ps (hc, hundred)),
+		_mm_castsi128_ps (_mm_or_si128 (_mm_cmpgt_epi32 (ti, t_limit), _mm_cmpgt_epi32 (hi, h_limit))));
+	    set_flags (flags + i, _mm_movemask_ps (bad), 4);
+	}
+    }
+    return i;
+}
+
+// eight readings per iteration
+__attribute__ ((target ("avx2")))
+size_t sht1x_avx2 (const uint16_t* temp, const uint16_t* humidity, size_t n, const sht1x_coeffs& c,
+    int32_t* t_out, int32_t* h_out, uint8_t* flags)
+{
+    const __m256 zero = _mm256_setzero_ps (), hundred = _mm256_set1_ps (100.0f), unit = _mm256_set1_ps (c.unit);
+    const __m256i t_limit = _mm256_set1_epi32 (0x3fff), h_limit = _mm256_set1_epi32 (0x0fff);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+	__m256i ti = _mm256_cvtepu16_epi32 (_mm_loadu_si128 (reinterpret_cast<const __m128i*> (temp + i)));
+	__m256i hi = _mm256_cvtepu16_epi32 (_mm_loadu_si128 (reinterpret_cast<const __m128i*> (humidity + i)));
+	__m256 st = _mm256_cvtepi32_ps (ti), srh = _mm256_cvtepi32_ps (hi);
+	__m256 t = _mm256_sub_ps (_mm256_mul_ps (st, _mm256_set1_ps (0.01f)), _mm256_set1_ps (39.7f));
+	__m256 rhl = _mm256_add_ps (_mm256_add_ps (_mm256_set1_ps (-2.0468f), _mm256_mul_ps (_mm256_set1_ps (0.0367f), srh)),
+	    _mm256_mul_ps (_mm256_set1_ps (-1.5955e-6f), _mm256_mul_ps (srh, srh)));
+	__m256 rh = _mm256_add_ps (_mm256_mul_ps (_mm256_sub_ps (t, _mm256_set1_ps (25.0f)),
+	    _mm256_add_ps (_mm256_set1_ps (0.01f), _mm256_mul_ps (_mm256_set1_ps (0.00008f), srh))), rhl);
+	__m256 tc = _mm256_add_ps (_mm256_mul_ps (t, _mm256_set1_ps (c.t.gain)), _mm256_set1_ps (c.t.offset));
+	__m256 hc = _mm256_add_ps (_mm256_mul_ps (rh, _mm256_set1_ps (c.h.gain)), _mm256_set1_ps (c.h.offset));
+	__m256 clamped = _mm256_min_ps (_mm256_max_ps (hc, zero), hundred);
+	store8 (t_out + i, _mm256_mul_ps (tc, unit));
+	store8 (h_out + i, _mm256_mul_ps (clamped, unit));
+	if (flags) {
+	    __m256 bad = _mm256_or_ps (_mm256_or_ps (_mm256_cmp_ps (hc, zero, _CMP_LT_OQ), _mm256_cmp_ps (hc, hundred, _CMP_GT_OQ)),
+		_mm256_castsi256_ps (_mm256_or_si256 (_mm256_cmpgt_epi32 (ti, t_limit), _mm256_cmpgt_epi32 (hi, h_limit))));
+	    set_flags (flags + i, _mm256_movemask_ps (bad), 8);
+	}
+    }
+    return i;
+}
+
+#endif
+
+decode_kernel best_kernel () {
+#ifdef TEMPER_X86
+    return __builtin_cpu_supports ("avx2") ? decode_avx2 : decode_sse2;
+#else
+    return decode_scalar;
+#endif
+}
+
+decode_kernel kernel = best_kernel ();
+
+template <typename T>
+void decode_temper (const uint8_t* raw, size_t n, const temper_coeffs& c, T* out, uint8_t* flags) {
+    size_t done = 0;
+#ifdef TEMPER_X86
+    if (kernel == decode_avx2)
+	done = temper_avx2 (raw, n, c, out, flags);
+    else if (kernel == decode_sse2)
+	done = temper_sse2 (raw, n, c, out, flags);
+#endif
+    temper_scalar (raw + 2 * done, n - done, c, out + done, flags ? flags + done : nullptr);
+}
+
+} // namespace
+
+decode_kernel decode_best () {
+    return best_kernel ();
+}
+
+void decode_use (decode_kernel k) {
+    kernel = std::min (k, best_kernel ());
+}
+
+void decode_temper (const uint8_t* raw, size_t n, const calibration& cal, float* out, uint8_t* flags) {
+    decode_temper (raw, n, temper_coeffs (cal, 1), out, flags);
+}
+
+void decode_temper (const uint8_t* raw, size_t n, const calibration& cal, int32_t* out, uint8_t* flags) {
+    decode_temper (raw, n, temper_coeffs (cal, 1000), out, flags);
+}
+
+void decode_sht1x (const uint16_t* temp, const uint16_t* humidity, size_t n,
+    const calibration& temp_cal, const calibration& humidity_cal,
+    int32_t* temp_out, int32_t* humidity_out, uint8_t* flags)
+{
+    sht1x_coeffs c;
+    c.t = temp_cal;
+    c.h = humidity_cal;
+    size_t done = 0;
+#ifdef TEMPER_X86
+    if (kernel == decode_avx2)
+	done = sht1x_avx2 (temp, humidity, n, c, temp_out, humidity_out, flags);
+    else if (kernel == decode_sse2)
+	done = sht1x_sse2 (temp, humidity, n, c, temp_out, humidity_out, flags);
+#endif
+    sht1x_scalar (temp + done, humidity + done, n - done, c, temp_out + done, humidity_out + done,
+	flags ? flags + done : nullptr);
+}
+
+// vim: ts=8 sts=4 sw=4 et
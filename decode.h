@@ -0,0 +1,51 @@
+#ifndef TEMPER_DECODE_H
+#define TEMPER_DECODE_H
+
+// Batch conversion of raw sensor words to readings.
+//
+// The kernels use AVX2 when the CPU has it, SSE2 otherwise on x86-64 and
+// plain C++ elsewhere; all three give bit-identical results. Outputs are
+// either float degrees/percent or fixed-point thousandths, as stored in a
+// sample's value.
+
+#include <cstddef>
+#include <cstdint>
+
+// Linear correction applied after conversion: gain * reading + offset,
+// with offset in degrees Celsius (or percent RH).
+struct calibration {
+    float gain = 1;
+    float offset = 0;
+};
+
+// TEMPer1 reports: n pairs of bytes (d[0], d[1]) forming a big-endian
+// two's complement word in 1/256 degrees. If flags is not null, each
+// flags[i] is set to sample_invalid for a reading outside the sensor's
+// -55..125 degree range or the bus-idle pattern 0xffff, and to 0 otherwise.
+void decode_temper (const uint8_t* raw, size_t n, const calibration& cal, float* out, uint8_t* flags);
+void decode_temper (const uint8_t* raw, size_t n, const calibration& cal, int32_t* out, uint8_t* flags);
+
+// TEMPerHUM (SHT1x) reports: n 14-bit temperature words and n 12-bit
+// humidity words, converted with the datasheet's 5V coefficients and
+// temperature-compensated. Humidity is clamped to 0..100. flags[i] is set
+// to sample_invalid for words out of range or humidity that needed
+// clamping, and to 0 otherwise.
+void decode_sht1x (const uint16_t* temp, const uint16_t* humidity, size_t n,
+    const calibration& temp_cal, const calibration& humidity_cal,
+    int32_t* temp_out, int32_t* humidity_out, uint8_t* flags);
+
+enum decode_kernel {
+    decode_scalar,
+    decode_sse2,
+    decode_avx2
+};
+
+// The widest kernels the CPU can run, which are used unless decode_use ()
+// narrows them, to check that they agree. decode_use () is not thread-safe:
+// call it while nothing is decoding.
+decode_kernel decode_best ();
+void decode_use (decode_kernel k);
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
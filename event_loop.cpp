@@ -0,0 +1,124 @@
+#include "event_loop.h"
+
+#include <csignal>
+
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+event_loop::event_loop ():
+    epoll (posix_check (epoll_create1 (EPOLL_CLOEXEC), "epoll_create1"))
+{}
+
+void event_loop::add (int fd, uint32_t events, handler h) {
+    uint32_t g = ++generation;
+    epoll_event ev {};
+    ev.events = events;
+    ev.data.u64 = uint64_t (g) << 32 | uint32_t (fd);
+    posix_check (epoll_ctl (epoll.get (), EPOLL_CTL_ADD, fd, &ev), "epoll_ctl");
+    watches[fd] = watch {g, std::move (h)};
+}
+
+void event_loop::modify (int fd, uint32_t events) {
+    epoll_event ev {};
+    ev.events = events;
+    ev.data.u64 = uint64_t (watches.at (fd).generation) << 32 | uint32_t (fd);
+    posix_check (epoll_ctl (epoll.get (), EPOLL_CTL_MOD, fd, &ev), "epoll_ctl");
+}
+
+void event_loop::remove (int fd) {
+    if (watches.erase (fd))
+	epoll_ctl (epoll.get (), EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void event_loop::run () {
+    stopping = false;
+    epoll_event events[64];
+    while (!stopping) {
+	int n = epoll_wait (epoll.get (), events, 64, -1);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	posix_check (n, "epoll_wait");
+	for (int i = 0; i < n && !stopping; ++i) {
+	    int fd = int (events[i].data.u64 & 0xffffffff);
+	    uint32_t g = events[i].data.u64 >> 32;
+	    auto w = watches.find (fd);
+	    if (w == watches.end () || w->second.generation != g)
+		continue;
+	    // the handler may remove itself
+	    handler h = w->second.h;
+	    h (events[i].events);
+	}
+	while (!deferred.empty ()) {
+	    std::vector<std::function<void ()>> v;
+	    v.swap (deferred);
+	    for (auto& f: v)
+		f ();
+	}
+    }
+}
+
+namespace {
+
+itimerspec to_itimerspec (std::chrono::nanoseconds delay, std::chrono::nanoseconds period) {
+    itimerspec its {};
+    its.it_value.tv_sec = delay.count () / 1000000000;
+    its.it_value.tv_nsec = delay.count () % 1000000000;
+    // a zero it_value would disarm the timer
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+	its.it_value.tv_nsec = 1;
+    its.it_interval.tv_sec = period.count () / 1000000000;
+    its.it_interval.tv_nsec = period.count () % 1000000000;
+    return its;
+}
+
+} // namespace
+
+loop_timer::loop_timer (event_loop& loop, handler h):
+    loop (loop),
+    h (std::move (h)),
+    fd (posix_check (timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), "timerfd_create"))
+{
+    loop.add (fd.get (), EPOLLIN, [this] (uint32_t) {
+	uint64_t expiries;
+	if (::read (fd.get (), &expiries, sizeof expiries) == sizeof expiries)
+	    this->h ();
+    });
+}
+
+loop_timer::~loop_timer () {
+    loop.remove (fd.get ());
+}
+
+void loop_timer::start (std::chrono::nanoseconds delay, std::chrono::nanoseconds period) {
+    itimerspec its = to_itimerspec (delay, period);
+    posix_check (timerfd_settime (fd.get (), 0, &its, nullptr), "timerfd_settime");
+}
+
+void loop_timer::cancel () {
+    itimerspec its {};
+    posix_check (timerfd_settime (fd.get (), 0, &its, nullptr), "timerfd_settime");
+}
+
+loop_signals::loop_signals (event_loop& loop, std::initializer_list<int> signals, handler h):
+    loop (loop),
+    h (std::move (h))
+{
+    sigset_t set;
+    sigemptyset (&set);
+    for (int s: signals)
+	sigaddset (&set, s);
+    pthread_sigmask (SIG_BLOCK, &set, nullptr);
+    fd.reset (posix_check (signalfd (-1, &set, SFD_NONBLOCK | SFD_CLOEXEC), "signalfd"));
+    loop.add (fd.get (), EPOLLIN, [this] (uint32_t) {
+	signalfd_siginfo si;
+	while (::read (fd.get (), &si, sizeof si) == sizeof si)
+	    this->h (si.ssi_signo);
+    });
+}
+
+loop_signals::~loop_signals () {
+    loop.remove (fd.get ());
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,99 @@
+#ifndef TEMPER_EVENT_LOOP_H
+#define TEMPER_EVENT_LOOP_H
+
+// A single-threaded epoll loop.
+//
+// Handlers are called on the thread that runs the loop, one at a time, so
+// anything they share needs no locking. A handler may add or remove any
+// descriptor, its own included; events still pending for a removed
+// descriptor are discarded, even if its number is reused meanwhile.
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
+
+#include "posix.h"
+
+class event_loop {
+public:
+    typedef std::function<void (uint32_t events)> handler;
+
+    event_loop ();
+    event_loop (const event_loop&) = delete;
+    event_loop& operator= (const event_loop&) = delete;
+
+    // events are EPOLLIN, EPOLLOUT and so on. The caller keeps ownership
+    // of fd and must remove it before closing it.
+    void add (int fd, uint32_t events, handler h);
+    void modify (int fd, uint32_t events);
+    void remove (int fd);
+
+    // Calls f once the events from the current epoll_wait have all been
+    // handled, for work worth batching across them.
+    void defer (std::function<void ()> f) { deferred.push_back (std::move (f)); }
+
+    // Dispatches events until stop ().
+    void run ();
+    void stop () { stopping = true; }
+
+private:
+    struct watch {
+	uint32_t generation;
+	handler h;
+    };
+
+    unique_fd epoll;
+    std::unordered_map<int, watch> watches;
+    std::vector<std::function<void ()>> deferred;
+    uint32_t generation = 0;
+    bool stopping = false;
+};
+
+// A timerfd on CLOCK_MONOTONIC whose expiries call a handler on the loop.
+class loop_timer {
+public:
+    typedef std::function<void ()> handler;
+
+    loop_timer (event_loop& loop, handler h);
+    ~loop_timer ();
+    loop_timer (const loop_timer&) = delete;
+    loop_timer& operator= (const loop_timer&) = delete;
+
+    // Fires after delay, then every period if that is non-zero. Expiries
+    // missed while the loop was busy are coalesced into one call.
+    void start (std::chrono::nanoseconds delay, std::chrono::nanoseconds period = {});
+    void cancel ();
+
+private:
+    event_loop& loop;
+    handler h;
+    unique_fd fd;
+};
+
+// Delivers the given signals on the loop through a signalfd. They are
+// blocked in the calling thread, which should be the one running the loop,
+// before any other threads are started.
+class loop_signals {
+public:
+    typedef std::function<void (int signal)> handler;
+
+    loop_signals (event_loop& loop, std::initializer_list<int> signals, handler h);
+    ~loop_signals ();
+    loop_signals (const loop_signals&) = delete;
+    loop_signals& operator= (const loop_signals&) = delete;
+
+private:
+    event_loop& loop;
+    handler h;
+    unique_fd fd;
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,179 @@
+#include "executor.h"
+
+#include <algorithm>
+#include <climits>
+#include <csignal>
+#include <system_error>
+#include <thread>
+
+#include <pthread.h>
+
+namespace {
+
+// Which of the pool's queues the calling thread owns, if it is a worker.
+thread_local const worker_pool* current_pool = nullptr;
+thread_local unsigned current_index = 0;
+
+}
+
+worker_pool::worker_pool (unsigned n, size_t stack) {
+    if (n == 0)
+	n = std::max (1u, std::thread::hardware_concurrency ());
+    for (unsigned i = 0; i < n; ++i) {
+	queues.emplace_back (new queue);
+	workers.emplace_back (this, i);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    int e = stack ? pthread_attr_setstacksize (&attr, std::max<size_t> (stack, PTHREAD_STACK_MIN)) : 0;
+    sigset_t all, old;
+    sigfillset (&all);
+    pthread_sigmask (SIG_BLOCK, &all, &old);
+    for (unsigned i = 0; i < n && !e; ++i) {
+	pthread_t t;
+	e = pthread_create (&t, &attr, &worker_pool::start, &workers[i]);
+	if (!e)
+	    threads.push_back (t);
+    }
+    pthread_sigmask (SIG_SETMASK, &old, nullptr);
+    pthread_attr_destroy (&attr);
+    if (e) {
+	join ();
+	throw std::system_error (e, std::generic_category (), "pthread_create");
+    }
+}
+
+worker_pool::~worker_pool () {
+    join ();
+}
+
+void worker_pool::join () {
+    stopping = true;
+    for (auto& q: queues)
+	if (q->parked.exchange (0))
+	    q->parked.notify_one ();
+    for (pthread_t t: threads)
+	pthread_join (t, nullptr);
+}
+
+void* worker_pool::start (void* worker) {
+    auto w = static_cast<std::pair<worker_pool*, unsigned>*> (worker);
+    w->first->run (w->second);
+    return nullptr;
+}
+
+void worker_pool::post (task t) {
+    unsigned i = current_pool == this ? current_index : next++ % queues.size ();
+    {
+	std::lock_guard<std::mutex> l (queues[i]->m);
+	queues[i]->tasks.push_back (std::move (t));
+	++pending;
+    }
+    // Either a worker going to sleep sees the task counted, or we see it
+    // counted among the parked; both sides use sequentially consistent
+    // operations for this.
+    if (parked)
+	wake_one (i);
+}
+
+// The worker of queue first, if it is parked, so that it runs the task
+// itself; otherwise the next parked one along, which will steal it.
+void worker_pool::wake_one (unsigned first) {
+    for (size_t k = 0; k < queues.size (); ++k) {
+	queue& q = *queues[(first + k) % queues.size ()];
+	if (q.parked.exchange (0)) {
+	    q.parked.notify_one ();
+	    return;
+	}
+    }
+}
+
+bool worker_pool::pop (unsigned self, task& t) {
+    {
+	queue& q = *queues[self];
+	std::lock_guard<std::mutex> l (q.m);
+	if (!q.tasks.empty ()) {
+	    t = std::move (q.tasks.back ());
+	    q.tasks.pop_back ();
+	    --pending;
+	    return true;
+	}
+    }
+    if (!pending)
+	return false;
+    for (size_t k = 1; k < queues.size (); ++k) {
+	queue& q = *queues[(self + k) % queues.size ()];
+	std::lock_guard<std::mutex> l (q.m);
+	if (!q.tasks.empty ()) {
+	    t = std::move (q.tasks.front ());
+	    q.tasks.pop_front ();
+	    --pending;
+	    return true;
+	}
+    }
+    return false;
+}
+
+void worker_pool::run (unsigned self) {
+    current_pool = this;
+    current_index = self;
+    queue& own = *queues[self];
+    for (;;) {
+	task t;
+	if (pop (self, t)) {
+	    t ();
+	    continue;
+	}
+	if (stopping)
+	    return;
+
+	// Announce that we are parking before looking one last time, so
+	// that a post either sees us parked or we see its task.
+	own.parked = 1;
+	++parked;
+	if (pending || stopping)
+	    own.parked = 0;
+	else
+	    own.parked.wait (1);
+	--parked;
+    }
+}
+
+strand::strand (worker_pool& pool):
+    pool (pool)
+{}
+
+strand::~strand () {
+    std::unique_lock<std::mutex> l (m);
+    idle.wait (l, [this] { return !running; });
+}
+
+void strand::post (worker_pool::task t) {
+    std::lock_guard<std::mutex> l (m);
+    tasks.push_back (std::move (t));
+    if (!running) {
+	running = true;
+	pool.post ([this] { run (); });
+    }
+}
+
+// Runs one task, then posts itself again if there are more rather than
+// looping, so that no worker is tied to a busy strand.
+void strand::run () {
+    worker_pool::task t;
+    {
+	std::lock_guard<std::mutex> l (m);
+	t = std::move (tasks.front ());
+	tasks.pop_front ();
+    }
+    t ();
+    std::lock_guard<std::mutex> l (m);
+    if (tasks.empty ()) {
+	running = false;
+	idle.notify_all ();
+    } else
+	pool.post ([this] { run (); });
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,99 @@
+#ifndef TEMPER_EXECUTOR_H
+#define TEMPER_EXECUTOR_H
+
+// A small work-stealing thread pool, and strands that serialise work on it.
+//
+// Each worker has its own deque. A worker takes the task it posted most
+// recently from the back of its own deque, and steals the oldest task from
+// the front of another worker's deque when its own is empty. Tasks posted
+// from outside the pool are spread round-robin across the deques.
+//
+// A worker that finds nothing parks on a futex of its own, and a post
+// wakes one parked worker, if there is one. Posting and taking a task
+// otherwise touch only the deque's lock and a couple of atomic counters.
+//
+// A strand runs the tasks posted to it one at a time, in order, on
+// whichever worker is free. State reached only through one strand (such as
+// a device handle) therefore needs no lock, yet many strands can make
+// progress in parallel on a few threads.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <pthread.h>
+
+class worker_pool {
+public:
+    typedef std::function<void ()> task;
+
+    // With zero threads, uses one per CPU; with a zero stack size, the
+    // system's default. The workers run with all signals blocked.
+    explicit worker_pool (unsigned threads = 0, size_t stack = 0);
+
+    // Runs whatever is still queued, then joins the workers.
+    ~worker_pool ();
+    worker_pool (const worker_pool&) = delete;
+    worker_pool& operator= (const worker_pool&) = delete;
+
+    // Tasks must not throw.
+    void post (task t);
+
+    unsigned size () const { return threads.size (); }
+
+private:
+    // A worker's deque, and what it parks on; a cache line apart from the
+    // next worker's.
+    struct alignas (64) queue {
+	std::mutex m;
+	std::deque<task> tasks;
+	std::atomic<uint32_t> parked {0};
+    };
+
+    static void* start (void* worker);
+    void join ();
+    void run (unsigned self);
+    bool pop (unsigned self, task& t);
+    void wake_one (unsigned first);
+
+    std::vector<std::unique_ptr<queue>> queues;
+    std::vector<std::pair<worker_pool*, unsigned>> workers;   // start ()'s arguments
+    std::vector<pthread_t> threads;
+    std::atomic<unsigned> next {0};
+
+    std::atomic<size_t> pending {0};    // tasks in the deques
+    std::atomic<unsigned> parked {0};   // workers parked, or about to be
+    std::atomic<bool> stopping {false};
+};
+
+class strand {
+public:
+    explicit strand (worker_pool& pool);
+
+    // Waits for the tasks already posted to finish.
+    ~strand ();
+    strand (const strand&) = delete;
+    strand& operator= (const strand&) = delete;
+
+    // Tasks must not throw.
+    void post (worker_pool::task t);
+
+private:
+    void run ();
+
+    worker_pool& pool;
+    std::mutex m;
+    std::condition_variable idle;
+    std::deque<worker_pool::task> tasks;
+    bool running = false;
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,272 @@
+#include "export.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+namespace {
+
+export_frame make_frame (uint8_t kind, uint64_t length, int64_t first_time, int64_t last_time) {
+    export_frame f {};
+    std::memcpy (f.magic, "TMPX", sizeof f.magic);
+    f.version = 1;
+    f.kind = kind;
+    f.length = length;
+    f.first_time = first_time;
+    f.last_time = last_time;
+    return f;
+}
+
+bool would_block () {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+} // namespace
+
+history_export::history_export (const std::string& dir, int64_t from, int64_t to) {
+    for (const auto& s: list_segments (dir))
+	if (s.last_time >= from && s.first_time <= to)
+	    segments.push_back (s);
+}
+
+// Opens the next segment and fills in its frame; false if none are left.
+bool history_export::open_next () {
+    while (next < segments.size ()) {
+	const segment_info& s = segments[next++];
+	// Compaction replaces segments by rename and never modifies them,
+	// so an open segment stays consistent. One that has gone since we
+	// listed the directory was merged into another.
+	current.reset (::open (s.path.c_str (), O_RDONLY | O_CLOEXEC));
+	if (!current) {
+	    if (errno == ENOENT)
+		continue;
+	    posix_check (-1, s.path);
+	}
+	// the active segment may still grow; send what it holds now
+	struct stat st;
+	posix_check (fstat (current.get (), &st), s.path);
+	frame = make_frame (s.kind, st.st_size, s.first_time, s.last_time);
+	offset = 0;
+	return true;
+    }
+    current.reset ();
+    return false;
+}
+
+// Sends the rest of the current segment; false if out would block or the
+// budget is spent first.
+bool history_export::send_body (int out, bool pipe, uint64_t& budget) {
+    while (offset < off_t (frame.length)) {
+	if (!budget)
+	    return false;
+	size_t n = std::min<uint64_t> (frame.length - offset, budget);
+	ssize_t r = pipe
+	    ? splice (current.get (), &offset, out, nullptr, n, SPLICE_F_MOVE | SPLICE_F_MORE)
+	    : sendfile (out, current.get (), &offset, n);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r < 0 && would_block ())
+	    return false;
+	if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+	    // the output takes neither (a terminal, say), so copy
+	    char buf[64 << 10];
+	    ssize_t got = posix_check (pread (current.get (), buf, std::min (n, sizeof buf), offset), "export");
+	    r = ::write (out, buf, got);
+	    if (r < 0 && errno == EINTR)
+		continue;
+	    if (r < 0 && would_block ())
+		return false;
+	    offset += posix_check (r, "export");
+	}
+	posix_check (r, "export");
+	if (r == 0)
+	    throw std::runtime_error ("export: segment shrank while sending");
+	sent += r;
+	budget -= std::min<uint64_t> (r, budget);
+    }
+    return true;
+}
+
+bool history_export::pump (int out, uint64_t budget) {
+    struct stat st;
+    bool pipe = fstat (out, &st) == 0 && S_ISFIFO (st.st_mode);
+    for (;;) {
+	switch (state) {
+	case next_frame:
+	    if (!open_next ())
+		frame = make_frame (0, 0, 0, 0);
+	    frame_sent = 0;
+	    state = in_frame;
+	    break;
+
+	case in_frame: {
+	    const char* p = reinterpret_cast<const char*> (&frame) + frame_sent;
+	    ssize_t r = ::write (out, p, sizeof frame - frame_sent);
+	    if (r < 0 && errno == EINTR)
+		continue;
+	    if (r < 0 && would_block ())
+		return false;
+	    frame_sent += posix_check (r, "export");
+	    sent += r;
+	    if (frame_sent == sizeof frame)
+		state = frame.kind ? in_body : finished;
+	    break;
+	}
+
+	case in_body:
+	    if (!send_body (out, pipe, budget))
+		return false;
+	    current.reset ();
+	    state = next_frame;
+	    break;
+
+	case finished:
+	    return true;
+	}
+    }
+}
+
+columnar_writer::columnar_writer (int out, size_t chunk_rows):
+    out (out),
+    chunk_rows (chunk_rows)
+{
+    static const column_desc schema[] = {
+	{"time", 'q'},
+	{"device", 'H'},
+	{"channel", 'B'},
+	{"value", 'i'},
+	{"flags", 'B'}
+    };
+    columnar_header h {};
+    std::memcpy (h.magic, "TMPC", sizeof h.magic);
+    h.version = 1;
+    h.big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+    h.columns = sizeof schema / sizeof *schema;
+    h.alignment = 64;
+    std::copy (std::begin (schema), std::end (schema), h.column);
+    emit (&h, sizeof h);
+}
+
+void columnar_writer::add (const sample& s) {
+    time.push_back (s.time);
+    device.push_back (s.device);
+    channel.push_back (s.channel);
+    value.push_back (s.value);
+    flags.push_back (s.flags);
+    if (time.size () == chunk_rows)
+	flush ();
+}
+
+void columnar_writer::finish () {
+    flush ();
+    columnar_trailer t {};
+    t.chunks = offsets.size ();
+    t.index_offset = pos;
+    std::memcpy (t.magic, "TMPC", sizeof t.magic);
+    emit (offsets.data (), offsets.size () * sizeof offsets[0]);
+    emit (&t, sizeof t);
+}
+
+void columnar_writer::flush () {
+    if (time.empty ())
+	return;
+
+    columnar_chunk c {};
+    std::memcpy (c.magic, "CHNK", sizeof c.magic);
+    c.rows = time.size ();
+    c.min_device = *std::min_element (device.begin (), device.end ());
+    c.max_device = *std::max_element (device.begin (), device.end ());
+    c.min_time = *std::min_element (time.begin (), time.end ());
+    c.max_time = *std::max_element (time.begin (), time.end ());
+    c.min_value = INT32_MAX;
+    c.max_value = INT32_MIN;
+    for (size_t i = 0; i < value.size (); ++i) {
+	if (flags[i] & sample_invalid) {
+	    ++c.invalid;
+	    continue;
+	}
+	c.min_value = std::min (c.min_value, value[i]);
+	c.max_value = std::max (c.max_value, value[i]);
+    }
+
+    // lay the columns out after the chunk header, each aligned
+    const std::pair<const void*, size_t> columns[] = {
+	{time.data (), sizeof time[0]},
+	{device.data (), sizeof device[0]},
+	{channel.data (), sizeof channel[0]},
+	{value.data (), sizeof value[0]},
+	{flags.data (), sizeof flags[0]}
+    };
+    align ();
+    uint64_t start = pos, at = sizeof c;
+    for (size_t i = 0; i < sizeof columns / sizeof *columns; ++i) {
+	at = (at + 63) & ~uint64_t (63);
+	c.column_offset[i] = at;
+	at += c.rows * columns[i].second;
+    }
+    offsets.push_back (start);
+    emit (&c, sizeof c);
+    for (const auto& col: columns) {
+	align ();
+	emit (col.first, c.rows * col.second);
+    }
+    align ();
+
+    time.clear ();
+    device.clear ();
+    channel.clear ();
+    value.clear ();
+    flags.clear ();
+}
+
+void columnar_writer::emit (const void* p, size_t n) {
+    write_all (out, p, n, "export");
+    pos += n;
+}
+
+void columnar_writer::align () {
+    static const char zeros[64] = {};
+    emit (zeros, -pos & 63);
+}
+
+void columnar_export (int out, const std::string& dir, int64_t from, int64_t to) {
+    columnar_writer w (out);
+    std::vector<char> buf (64 << 10);
+    for (const auto& s: list_segments (dir)) {
+	if (s.last_time < from || s.first_time > to)
+	    continue;
+	unique_fd fd (::open (s.path.c_str (), O_RDONLY | O_CLOEXEC));
+	if (!fd) {
+	    if (errno == ENOENT)
+		continue;       // merged away since we listed it
+	    posix_check (-1, s.path);
+	}
+	size_t n, per = buf.size () / s.header.record_size;
+	for (size_t at = 0; (n = read_records (fd.get (), s, at, buf.data (), per)); at += n) {
+	    for (size_t i = 0; i < n; ++i) {
+		sample x;
+		if (s.kind == segment_raw) {
+		    std::memcpy (&x, &buf[i * sizeof x], sizeof x);
+		} else {
+		    rollup r;
+		    std::memcpy (&r, &buf[i * sizeof r], sizeof r);
+		    x.time = r.start;
+		    x.device = r.device;
+		    x.channel = r.channel;
+		    x.flags = sample_rollup | (r.count ? 0 : sample_invalid);
+		    x.value = r.count ? r.sum / int64_t (r.count) : 0;
+		}
+		if (x.time >= from && x.time <= to)
+		    w.add (x);
+	    }
+	}
+    }
+    w.finish ();
+}
+
+// vim: ts=8 sts=4 sw=4 et
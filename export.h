@@ -0,0 +1,146 @@
+#ifndef TEMPER_EXPORT_H
+#define TEMPER_EXPORT_H
+
+// Bulk export of history segments.
+//
+// The stream is a sequence of frames, each an export_frame followed by
+// length bytes of a segment file exactly as stored (its segment_header
+// included), and ends with a frame whose length and kind are zero. The
+// segment bytes go from the page cache to the output with sendfile or,
+// for pipes, splice; they never pass through userspace.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "history.h"
+#include "posix.h"
+
+struct export_frame {
+    char magic[4];              // "TMPX"
+    uint8_t version;
+    uint8_t kind;               // segment_kind, zero for the end frame
+    uint16_t reserved;
+    uint64_t length;            // segment bytes that follow
+    int64_t first_time;
+    int64_t last_time;
+};
+static_assert (sizeof (export_frame) == 32, "export_frame is sent as-is");
+
+// Streams the segments overlapping [from, to]. pump() works on blocking
+// and non-blocking outputs alike, so an event loop can call it whenever
+// the output is writable.
+class history_export {
+public:
+    history_export (const std::string& dir, int64_t from, int64_t to);
+
+    // Sends as much as out accepts, or about budget bytes, whichever is
+    // less, so that an event loop can bound the time spent per wakeup;
+    // returns true once the end frame is out.
+    bool pump (int out, uint64_t budget = UINT64_MAX);
+
+    uint64_t bytes () const { return sent; }
+
+private:
+    bool open_next ();
+    bool send_body (int out, bool pipe, uint64_t& budget);
+
+    std::vector<segment_info> segments;
+    size_t next = 0;
+    enum { next_frame, in_frame, in_body, finished } state = next_frame;
+    unique_fd current;
+    export_frame frame;
+    size_t frame_sent = 0;
+    off_t offset = 0;
+    uint64_t sent = 0;
+};
+
+// Columnar export, for analytics tools that memory-map the file and scan
+// whole columns instead of parsing rows. All integers are in the byte
+// order given by columnar_header::big_endian. The file is:
+//
+//   columnar_header            describes the columns
+//   chunks                     a columnar_chunk, then one array per column,
+//                              each starting on a 64-byte boundary
+//   uint64_t offsets[chunks]   of each columnar_chunk from the file start
+//   columnar_trailer           at the very end of the file
+//
+// Column types are given as struct/NumPy format characters, so a reader
+// can build dtypes straight from the header.
+
+struct column_desc {
+    char name[11];
+    char type;                  // 'q' int64, 'i' int32, 'H' uint16, 'B' uint8
+};
+
+struct columnar_header {
+    char magic[4];              // "TMPC"
+    uint8_t version;
+    uint8_t big_endian;
+    uint8_t columns;
+    uint8_t reserved;
+    uint32_t alignment;         // of every column array
+    uint32_t reserved2;
+    column_desc column[8];
+    char pad[16];
+};
+static_assert (sizeof (columnar_header) == 128, "columnar_header is written as-is");
+
+// Statistics cover the chunk's rows; value ranges only rows that are not
+// flagged sample_invalid, so min_value > max_value if there are none.
+struct columnar_chunk {
+    char magic[4];              // "CHNK"
+    uint32_t rows;
+    uint32_t invalid;
+    uint16_t min_device;
+    uint16_t max_device;
+    int64_t min_time;
+    int64_t max_time;
+    int32_t min_value;
+    int32_t max_value;
+    uint64_t column_offset[8];  // from the start of this columnar_chunk
+    char pad[24];
+};
+static_assert (sizeof (columnar_chunk) == 128, "columnar_chunk is written as-is");
+
+struct columnar_trailer {
+    uint64_t chunks;
+    uint64_t index_offset;      // of the offsets array
+    uint32_t reserved;
+    char magic[4];              // "TMPC"
+};
+static_assert (sizeof (columnar_trailer) == 24, "columnar_trailer is written as-is");
+
+// Writes the columnar layout to a blocking descriptor, which need not be
+// seekable.
+class columnar_writer {
+public:
+    explicit columnar_writer (int out, size_t chunk_rows = 65536);
+
+    void add (const sample& s);
+    void finish ();
+
+private:
+    void flush ();
+    void emit (const void* p, size_t n);
+    void align ();
+
+    int out;
+    size_t chunk_rows;
+    uint64_t pos = 0;
+    std::vector<int64_t> time;
+    std::vector<uint16_t> device;
+    std::vector<uint8_t> channel;
+    std::vector<int32_t> value;
+    std::vector<uint8_t> flags;
+    std::vector<uint64_t> offsets;
+};
+
+// Writes the history in [from, to] to out in the columnar layout. Rollup
+// buckets become one row each, holding the bucket's mean and flagged
+// sample_rollup.
+void columnar_export (int out, const std::string& dir, int64_t from, int64_t to);
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,341 @@
+#include "expr.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+// Recursive descent straight to bytecode, tracking the stack depth the
+// code will need:
+//
+//   sum     := product (('+' | '-') product)*
+//   product := unary (('*' | '/') unary)*
+//   unary   := '-' unary | power
+//   power   := primary ('^' unary)?
+//   primary := number | variable ('[' integer ']')? | function '(' args ')'
+//            | '(' sum ')'
+class expression_parser {
+public:
+    expression_parser (expression& e, const std::string& text, const expression::resolver& resolve):
+	e (e),
+	text (text),
+	resolve (resolve)
+    {}
+
+    void parse () {
+	sum ();
+	skip_space ();
+	if (at < text.size ())
+	    fail ("unexpected character");
+	if (depth != 1)
+	    fail ("internal error");
+    }
+
+private:
+    [[noreturn]] void fail (const char* what) const {
+	throw std::runtime_error (std::string (what) + " at offset " + std::to_string (at) + " in: " + text);
+    }
+
+    void skip_space () {
+	while (at < text.size () && (text[at] == ' ' || text[at] == '\t'))
+	    ++at;
+    }
+
+    bool accept (char c) {
+	skip_space ();
+	if (at < text.size () && text[at] == c) {
+	    ++at;
+	    return true;
+	}
+	return false;
+    }
+
+    void expect (char c) {
+	if (!accept (c)) {
+	    char what[] = "expected 'x'";
+	    what[10] = c;
+	    fail (what);
+	}
+    }
+
+    void emit (expression::opcode op, uint32_t arg = 0) {
+	e.code.push_back (expression::instr {op, arg});
+	switch (op) {
+	case expression::op_const:
+	case expression::op_slot:
+	    if (++depth > expression::max_depth)
+		fail ("expression too deep");
+	    break;
+	case expression::op_add: case expression::op_sub: case expression::op_mul: case expression::op_div:
+	case expression::op_pow: case expression::op_min: case expression::op_max:
+	    --depth;
+	    break;
+	default:
+	    break;
+	}
+    }
+
+    void sum () {
+	product ();
+	for (;;) {
+	    if (accept ('+')) {
+		product ();
+		emit (expression::op_add);
+	    } else if (accept ('-')) {
+		product ();
+		emit (expression::op_sub);
+	    } else {
+		return;
+	    }
+	}
+    }
+
+    void product () {
+	unary ();
+	for (;;) {
+	    if (accept ('*')) {
+		unary ();
+		emit (expression::op_mul);
+	    } else if (accept ('/')) {
+		unary ();
+		emit (expression::op_div);
+	    } else {
+		return;
+	    }
+	}
+    }
+
+    // Every way of nesting (a sign, a bracket, a function's argument, an
+    // exponent) comes back through here, so this is where it is counted.
+    void unary () {
+	if (++nesting > expression::max_nesting)
+	    fail ("expression nested too deeply");
+	if (accept ('-')) {
+	    unary ();
+	    emit (expression::op_neg);
+	} else {
+	    power ();
+	}
+	--nesting;
+    }
+
+    void power () {
+	primary ();
+	if (accept ('^')) {
+	    unary ();
+	    emit (expression::op_pow);
+	}
+    }
+
+    std::string identifier () {
+	size_t start = at;
+	while (at < text.size () && (std::isalnum ((unsigned char) text[at]) || text[at] == '_'))
+	    ++at;
+	return text.substr (start, at - start);
+    }
+
+    void primary () {
+	skip_space ();
+	if (at == text.size ())
+	    fail ("unexpected end");
+	char c = text[at];
+
+	if (std::isdigit ((unsigned char) c) || c == '.') {
+	    double v;
+	    auto r = std::from_chars (text.data () + at, text.data () + text.size (), v);
+	    if (r.ec != std::errc ())
+		fail ("bad number");
+	    at = r.ptr - text.data ();
+	    e.constants.push_back (v);
+	    emit (expression::op_const, e.constants.size () - 1);
+	    return;
+	}
+
+	if (accept ('(')) {
+	    sum ();
+	    expect (')');
+	    return;
+	}
+
+	if (!std::isalpha ((unsigned char) c))
+	    fail ("unexpected character");
+	size_t start = at;
+	std::string name = identifier ();
+
+	static const struct {
+	    const char* name;
+	    expression::opcode op;
+	    int args;
+	} functions[] = {
+	    {"abs", expression::op_abs, 1},
+	    {"sqrt", expression::op_sqrt, 1},
+	    {"exp", expression::op_exp, 1},
+	    {"ln", expression::op_ln, 1},
+	    {"log10", expression::op_log10, 1},
+	    {"min", expression::op_min, 2},
+	    {"max", expression::op_max, 2}
+	};
+	for (const auto& f: functions) {
+	    if (name != f.name)
+		continue;
+	    expect ('(');
+	    for (int i = 0; i < f.args; ++i) {
+		if (i)
+		    expect (',');
+		sum ();
+	    }
+	    expect (')');
+	    emit (f.op);
+	    return;
+	}
+
+	uint8_t channel;
+	if (name == "inner")
+	    channel = channel_inner;
+	else if (name == "outer")
+	    channel = channel_outer;
+	else if (name == "humidity")
+	    channel = channel_humidity;
+	else {
+	    at = start;
+	    fail ("unknown name");
+	}
+	int device = -1;
+	if (accept ('[')) {
+	    skip_space ();
+	    auto r = std::from_chars (text.data () + at, text.data () + text.size (), device);
+	    if (r.ec != std::errc () || device < 0 || device > 0xffff)
+		fail ("bad device");
+	    at = r.ptr - text.data ();
+	    expect (']');
+	}
+	emit (expression::op_slot, resolve (channel, device));
+    }
+
+    expression& e;
+    const std::string& text;
+    const expression::resolver& resolve;
+    size_t at = 0;
+    size_t depth = 0;
+    size_t nesting = 0;
+};
+
+expression::expression (const std::string& text, const resolver& resolve) {
+    expression_parser (*this, text, resolve).parse ();
+}
+
+namespace {
+
+// pow (NaN, 0), pow (1, NaN), fmin and fmax give a number for a NaN
+// operand, but a missing input has to leave the result missing.
+double unless_nan (double a, double b, double r) {
+    return std::isnan (a) || std::isnan (b) ? std::numeric_limits<double>::quiet_NaN () : r;
+}
+
+} // namespace
+
+double expression::eval (const double* slots) const {
+    double stack[max_depth];
+    double* top = stack;        // one past the top
+    for (const instr& i: code) {
+	switch (i.op) {
+	case op_const:  *top++ = constants[i.arg]; break;
+	case op_slot:   *top++ = slots[i.arg]; break;
+	case op_add:    --top; top[-1] += top[0]; break;
+	case op_sub:    --top; top[-1] -= top[0]; break;
+	case op_mul:    --top; top[-1] *= top[0]; break;
+	case op_div:    --top; top[-1] /= top[0]; break;
+	case op_pow:    --top; top[-1] = unless_nan (top[-1], top[0], std::pow (top[-1], top[0])); break;
+	case op_min:    --top; top[-1] = unless_nan (top[-1], top[0], std::fmin (top[-1], top[0])); break;
+	case op_max:    --top; top[-1] = unless_nan (top[-1], top[0], std::fmax (top[-1], top[0])); break;
+	case op_neg:    top[-1] = -top[-1]; break;
+	case op_abs:    top[-1] = std::fabs (top[-1]); break;
+	case op_sqrt:   top[-1] = std::sqrt (top[-1]); break;
+	case op_exp:    top[-1] = std::exp (top[-1]); break;
+	case op_ln:     top[-1] = std::log (top[-1]); break;
+	case op_log10:  top[-1] = std::log10 (top[-1]); break;
+	}
+    }
+    return stack[0];
+}
+
+derived_spec parse_derived_spec (const std::string& s) {
+    derived_spec d;
+    size_t eq = s.find ('=');
+    if (eq == std::string::npos)
+	throw std::runtime_error ("bad derived channel, expected [DEVICE:]NAME=EXPR: " + s);
+    std::string lhs = s.substr (0, eq);
+    size_t colon = lhs.find (':');
+    if (colon != std::string::npos) {
+	auto r = std::from_chars (lhs.data (), lhs.data () + colon, d.device);
+	if (r.ec != std::errc () || r.ptr != lhs.data () + colon || d.device < 0 || d.device > 0xffff)
+	    throw std::runtime_error ("bad device in derived channel: " + s);
+	lhs.erase (0, colon + 1);
+    }
+    // names go into CSV and JSON as they are, within output's record bound
+    if (lhs.empty () || lhs.size () > 32 || !std::all_of (lhs.begin (), lhs.end (),
+	    [] (char c) { return std::isalnum ((unsigned char) c) || c == '_' || c == '-' || c == '.'; }))
+	throw std::runtime_error ("bad derived channel name: " + s);
+    d.name = lhs;
+    d.text = s.substr (eq + 1);
+    return d;
+}
+
+derived_channels::derived_channels (const std::vector<derived_spec>& specs, const std::vector<uint16_t>& devices):
+    devices (devices),
+    slots (devices.size () * 3)
+{
+    if (specs.size () > 256 - channel_derived)
+	throw std::runtime_error ("too many derived channels");
+
+    auto index = [this] (int device) -> size_t {
+	auto i = std::find (this->devices.begin (), this->devices.end (), device);
+	if (i == this->devices.end ())
+	    throw std::runtime_error ("no device " + std::to_string (device));
+	return i - this->devices.begin ();
+    };
+
+    for (size_t k = 0; k < specs.size (); ++k) {
+	const derived_spec& d = specs[k];
+	channel_names.push_back (d.name);
+	for (uint16_t dev: devices) {
+	    if (d.device >= 0 && d.device != dev)
+		continue;
+	    expression e (d.text, [&] (uint8_t channel, int device) {
+		return index (device < 0 ? dev : device) * 3 + channel;
+	    });
+	    programs.push_back (program {dev, uint8_t (channel_derived + k), std::move (e)});
+	}
+	if (d.device >= 0)
+	    index (d.device);
+    }
+}
+
+void derived_channels::apply (const sample* begin, const sample* end, std::vector<sample>& out) {
+    const double missing = std::numeric_limits<double>::quiet_NaN ();
+    std::fill (slots.begin (), slots.end (), missing);
+    int64_t time = INT64_MIN;
+    for (const sample* s = begin; s != end; ++s) {
+	time = std::max (time, s->time);
+	auto i = std::find (devices.begin (), devices.end (), s->device);
+	if (i == devices.end () || s->channel > channel_humidity || (s->flags & sample_invalid))
+	    continue;
+	slots[(i - devices.begin ()) * 3 + s->channel] = s->value / 1000.0;
+    }
+    if (begin == end)
+	return;
+
+    for (const program& p: programs) {
+	double v = p.e.eval (slots.data ()) * 1000;
+	sample s {time, p.device, p.channel, 0, 0};
+	if (std::isfinite (v) && v > INT32_MIN && v < INT32_MAX)
+	    s.value = int32_t (std::lround (v));
+	else
+	    s.flags = sample_invalid;
+	out.push_back (s);
+    }
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,104 @@
+#ifndef TEMPER_EXPR_H
+#define TEMPER_EXPR_H
+
+// Derived channels: small arithmetic expressions over readings.
+//
+// An expression is compiled once into a flat bytecode for a stack
+// machine, and evaluating it allocates nothing. The language has numbers,
+// + - * / and ^ (power), unary minus, parentheses, the functions abs,
+// sqrt, exp, ln, log10, min and max, and variables naming a channel:
+// inner, outer or humidity for the device the expression is computed for,
+// or inner[N] and so on for device N. Values are in degrees Celsius and
+// percent RH; a missing or invalid input makes the result invalid.
+//
+// For example, the dew point from a TEMPerHUM, by the Magnus formula:
+//
+//   dewpoint=243.04*(ln(humidity/100)+17.625*inner/(243.04+inner))
+//            /(17.625-ln(humidity/100)-17.625*inner/(243.04+inner))
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "sample.h"
+
+class expression {
+public:
+    // Maps a variable to the index of its value in the slots given to
+    // eval (). device is -1 for the device the expression is computed for.
+    // Throws for a variable that cannot be had.
+    typedef std::function<size_t (uint8_t channel, int device)> resolver;
+
+    // Throws std::runtime_error for a syntax error, naming the offset.
+    expression (const std::string& text, const resolver& resolve);
+
+    double eval (const double* slots) const;
+
+    // Deepest the evaluation stack may get.
+    static constexpr size_t max_depth = 32;
+
+    // Deepest the parser may recurse, in signs, brackets, function
+    // arguments and exponents.
+    static constexpr size_t max_nesting = 64;
+
+private:
+    enum opcode: uint8_t {
+	op_const, op_slot,
+	op_add, op_sub, op_mul, op_div, op_pow, op_neg,
+	op_abs, op_sqrt, op_exp, op_ln, op_log10, op_min, op_max
+    };
+
+    struct instr {
+	opcode op;
+	uint32_t arg;           // op_const: constant index; op_slot: slot
+    };
+
+    friend class expression_parser;
+
+    std::vector<instr> code;
+    std::vector<double> constants;
+};
+
+// --derive [DEVICE:]NAME=EXPR: computed for every device, or for DEVICE
+// alone.
+struct derived_spec {
+    int device = -1;
+    std::string name;
+    std::string text;
+};
+
+derived_spec parse_derived_spec (const std::string& s);
+
+// Evaluates every derived channel on each round of readings. Derived
+// channel k is output as channel channel_derived + k.
+class derived_channels {
+public:
+    // devices are the ids of the devices present.
+    derived_channels (const std::vector<derived_spec>& specs, const std::vector<uint16_t>& devices);
+
+    // Appends one sample per derived channel and device, computed from the
+    // readings in [begin, end) and timed as the latest of them. A channel
+    // with no reading in the range counts as missing.
+    void apply (const sample* begin, const sample* end, std::vector<sample>& out);
+
+    // For sample_output::name_channel ().
+    const std::vector<std::string>& names () const { return channel_names; }
+
+private:
+    struct program {
+	uint16_t device;
+	uint8_t channel;
+	expression e;
+    };
+
+    std::vector<uint16_t> devices;
+    std::vector<program> programs;
+    std::vector<std::string> channel_names;
+    std::vector<double> slots;          // 3 per device, by channel
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
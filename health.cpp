@@ -0,0 +1,40 @@
+#include "health.h"
+
+health_snapshot device_health::snapshot () const {
+    health_snapshot s;
+    s.transfers = transfers.load (std::memory_order_relaxed);
+    s.bytes = bytes.load (std::memory_order_relaxed);
+    for (unsigned i = 0; i < health_errors; ++i)
+	s.errors[i] = errors[i].load (std::memory_order_relaxed);
+    s.short_reads = short_reads.load (std::memory_order_relaxed);
+    s.retries = retries.load (std::memory_order_relaxed);
+    s.resets = resets.load (std::memory_order_relaxed);
+    s.rejected = rejected.load (std::memory_order_relaxed);
+    return s;
+}
+
+health_snapshot operator- (const health_snapshot& now, const health_snapshot& then) {
+    health_snapshot d;
+    d.transfers = now.transfers - then.transfers;
+    d.bytes = now.bytes - then.bytes;
+    for (unsigned i = 0; i < health_errors; ++i)
+	d.errors[i] = now.errors[i] - then.errors[i];
+    d.short_reads = now.short_reads - then.short_reads;
+    d.retries = now.retries - then.retries;
+    d.resets = now.resets - then.resets;
+    d.rejected = now.rejected - then.rejected;
+    return d;
+}
+
+void health_format (std::ostream& o, const health_snapshot& s) {
+    static const char* const error_names[health_errors] = {
+	"timeout", "pipe", "no_device", "io", "overflow", "other"
+    };
+    o << "transfers=" << s.transfers << " bytes=" << s.bytes;
+    for (unsigned i = 0; i < health_errors; ++i)
+	o << ' ' << error_names[i] << '=' << s.errors[i];
+    o << " short_reads=" << s.short_reads << " retries=" << s.retries
+	<< " resets=" << s.resets << " rejected=" << s.rejected;
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,75 @@
+#ifndef TEMPER_HEALTH_H
+#define TEMPER_HEALTH_H
+
+// Per-device health counters: transfers and their bytes, failed transfers
+// by class, short reads, retries, resets and readings rejected as invalid.
+//
+// The thread doing a device's transfers bumps its counters; any other may
+// read them at any time without a lock. They are relaxed atomics, so each
+// counter is exact but a snapshot taken while transfers are under way need
+// not be consistent across counters. A device's counters start on a cache
+// line of their own, so that devices read from different threads do not
+// contend.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+enum health_error: uint8_t {
+    error_timeout,
+    error_pipe,                 // stalled
+    error_no_device,            // unplugged
+    error_io,
+    error_overflow,
+    error_other,
+    health_errors
+};
+
+struct health_snapshot {
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t errors[health_errors];
+    uint64_t short_reads;
+    uint64_t retries;
+    uint64_t resets;
+    uint64_t rejected;
+};
+
+class alignas (64) device_health {
+public:
+    void transfer (size_t n) {
+	bump (transfers);
+	bytes.fetch_add (n, std::memory_order_relaxed);
+    }
+    void error (health_error e) { bump (errors[e]); }
+    void short_read () { bump (short_reads); }
+    void retry () { bump (retries); }
+    void reset () { bump (resets); }
+    void reject () { bump (rejected); }
+
+    health_snapshot snapshot () const;
+
+private:
+    static void bump (std::atomic<uint64_t>& c) {
+	c.fetch_add (1, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> transfers {0};
+    std::atomic<uint64_t> bytes {0};
+    std::atomic<uint64_t> errors[health_errors] {};
+    std::atomic<uint64_t> short_reads {0};
+    std::atomic<uint64_t> retries {0};
+    std::atomic<uint64_t> resets {0};
+    std::atomic<uint64_t> rejected {0};
+};
+
+// What the counters went up by from then to now.
+health_snapshot operator- (const health_snapshot& now, const health_snapshot& then);
+
+// The counters as "transfers=N bytes=N timeout=N ...", without a newline.
+void health_format (std::ostream& o, const health_snapshot& s);
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
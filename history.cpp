@@ -0,0 +1,519 @@
+#include "history.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <tuple>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "realtime.h"
+
+namespace {
+
+const char segment_magic[4] = {'T', 'M', 'P', 'S'};
+
+// Compaction bookkeeping files, all inside the history directory.
+const char lock_name[] = "compact.lock";
+const char tmp_name[] = "compact.tmp";
+const char intent_name[] = "compact.intent";
+const char intent_tmp_name[] = "compact.intent.tmp";
+
+struct dir_closer {
+    void operator() (DIR* d) const { closedir (d); }
+};
+typedef std::unique_ptr<DIR, dir_closer> unique_dir;
+
+const bool host_big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+
+std::string join (const std::string& dir, const std::string& name) {
+    return dir + '/' + name;
+}
+
+const char* kind_name (segment_kind kind) {
+    return kind == segment_raw ? "raw" : "rollup";
+}
+
+std::string segment_name (segment_kind kind, int64_t first_time) {
+    char buf[64];
+    std::snprintf (buf, sizeof buf, "%s-%019" PRId64 ".seg", kind_name (kind), first_time);
+    return buf;
+}
+
+segment_header make_header (segment_kind kind) {
+    segment_header h {};
+    std::memcpy (h.magic, segment_magic, sizeof h.magic);
+    h.version = 1;
+    h.kind = kind;
+    h.big_endian = host_big_endian;
+    h.record_size = kind == segment_raw ? sizeof (sample) : sizeof (rollup);
+    return h;
+}
+
+bool read_header (int fd, segment_header& h) {
+    return pread (fd, &h, sizeof h, 0) == sizeof h
+	&& std::memcmp (h.magic, segment_magic, sizeof h.magic) == 0
+	&& h.version == 1
+	&& h.big_endian == host_big_endian
+	&& (h.kind == segment_raw || h.kind == segment_rollup)
+	&& h.record_size == (h.kind == segment_raw ? sizeof (sample) : sizeof (rollup));
+}
+
+void fsync_dir (const std::string& dir) {
+    unique_fd d (posix_check (::open (dir.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC), dir));
+    posix_check (::fsync (d.get ()), dir);
+}
+
+void unlink_if_present (const std::string& path) {
+    if (::unlink (path.c_str ()) < 0 && errno != ENOENT)
+	posix_check (-1, path);
+}
+
+// Opens a segment and takes the exclusive lock that keeps writers out of it
+// until it has been replaced; returns an invalid fd if it is busy.
+unique_fd lock_segment (const segment_info& s) {
+    unique_fd fd (::open (s.path.c_str (), O_RDONLY | O_CLOEXEC));
+    if (fd && flock (fd.get (), LOCK_EX | LOCK_NB) < 0)
+	fd.reset ();
+    return fd;
+}
+
+// Both nice and ioprio_set apply to the calling thread only on Linux.
+void lower_priority () {
+    const int ioprio_who_process = 1, ioprio_class_idle = 3, ioprio_class_shift = 13;
+    pid_t tid = syscall (SYS_gettid);
+    syscall (SYS_ioprio_set, ioprio_who_process, tid, ioprio_class_idle << ioprio_class_shift);
+    setpriority (PRIO_PROCESS, tid, 19);
+}
+
+} // namespace
+
+std::vector<segment_info> list_segments (const std::string& dir) {
+    unique_dir d (opendir (dir.c_str ()));
+    if (!d)
+	posix_check (-1, dir);
+
+    std::vector<segment_info> result;
+    while (dirent* e = readdir (d.get ())) {
+	char kind[8];
+	int64_t first;
+	int end = 0;
+	if (std::sscanf (e->d_name, "%7[a-z]-%" SCNd64 ".seg%n", kind, &first, &end) != 2 || e->d_name[end])
+	    continue;
+
+	segment_info s;
+	s.path = join (dir, e->d_name);
+	unique_fd fd (::open (s.path.c_str (), O_RDONLY | O_CLOEXEC));
+	struct stat st;
+	if (!fd || fstat (fd.get (), &st) < 0 || !read_header (fd.get (), s.header)
+	    || segment_name (segment_kind (s.header.kind), first) != e->d_name)
+	    continue;
+	s.kind = segment_kind (s.header.kind);
+	s.size = st.st_size;
+	s.first_time = first;
+	s.last_time = first;
+	if (s.header.compacted) {
+	    s.last_time = s.header.last_time;
+	} else if (size_t n = s.records ()) {
+	    int64_t t;
+	    if (pread (fd.get (), &t, sizeof t, sizeof (segment_header) + (n - 1) * s.header.record_size) == sizeof t)
+		s.last_time = t;
+	}
+	result.push_back (s);
+    }
+
+    std::sort (result.begin (), result.end (), [](const segment_info& a, const segment_info& b) {
+	return std::tie (a.first_time, a.kind) < std::tie (b.first_time, b.kind);
+    });
+    return result;
+}
+
+size_t read_records (int fd, const segment_info& seg, size_t first, void* out, size_t n) {
+    size_t total = seg.records ();
+    if (first >= total)
+	return 0;
+    n = std::min (n, total - first);
+    size_t rs = seg.header.record_size;
+    ssize_t r = posix_check (pread (fd, out, n * rs, sizeof (segment_header) + first * rs), seg.path);
+    return r / rs;
+}
+
+history_writer::history_writer (history_config c): cfg (std::move (c)) {
+    if (mkdir (cfg.dir.c_str (), 0777) < 0 && errno != EEXIST)
+	posix_check (-1, cfg.dir);
+}
+
+void history_writer::open_segment (int64_t time) {
+    auto segs = list_segments (cfg.dir);
+    auto newest = std::find_if (segs.rbegin (), segs.rend (), [](const segment_info& s) {
+	return s.kind == segment_raw;
+    });
+    if (newest != segs.rend () && !newest->header.compacted && newest->size < cfg.segment_bytes
+	&& (newest->size - sizeof (segment_header)) % sizeof (sample) == 0) {
+	fd.reset (::open (newest->path.c_str (), O_WRONLY | O_APPEND | O_CLOEXEC));
+	if (fd)
+	    return;
+    }
+
+    // New segments are written under a private name and linked into place,
+    // so they never appear without a header.
+    segment_header h = make_header (segment_raw);
+    std::string tmp = join (cfg.dir, "." + segment_name (segment_raw, time) + "." + std::to_string (getpid ()));
+    {
+	unique_fd t (posix_check (::open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666), tmp));
+	h.first_time = time;
+	write_all (t.get (), &h, sizeof h, tmp);
+    }
+    std::string path;
+    for (;; ++time) {
+	path = join (cfg.dir, segment_name (segment_raw, time));
+	if (::link (tmp.c_str (), path.c_str ()) == 0)
+	    break;
+	if (errno != EEXIST) {
+	    int e = errno;
+	    ::unlink (tmp.c_str ());
+	    throw std::system_error (e, std::generic_category (), path);
+	}
+    }
+    ::unlink (tmp.c_str ());
+    fd.reset (posix_check (::open (path.c_str (), O_WRONLY | O_APPEND | O_CLOEXEC), path));
+}
+
+void history_writer::append (const sample* s, size_t n) {
+    if (!n)
+	return;
+    for (;;) {
+	if (!fd)
+	    open_segment (s[0].time);
+
+	// The compactor holds an exclusive lock while it replaces a segment,
+	// so once we have a shared one a segment that is still linked stays
+	// current until we are done.
+	posix_check (flock (fd.get (), LOCK_SH), cfg.dir);
+	struct stat st;
+	posix_check (fstat (fd.get (), &st), cfg.dir);
+	if (st.st_nlink == 0 || st.st_size >= cfg.segment_bytes
+	    || (st.st_size - sizeof (segment_header)) % sizeof (sample)) {
+	    fd.reset ();
+	    continue;
+	}
+	write_all (fd.get (), s, n * sizeof *s, cfg.dir);
+	flock (fd.get (), LOCK_UN);
+	return;
+    }
+}
+
+compactor::compactor (history_config c): cfg (std::move (c)) {}
+
+compactor::~compactor () {
+    stop ();
+}
+
+void compactor::start () {
+    stopping = false;
+
+    // leave signals to the threads that expect them
+    sigset_t all, old;
+    sigfillset (&all);
+    pthread_sigmask (SIG_BLOCK, &all, &old);
+    thread = std::thread ([this] {
+	realtime_leave ();
+	std::unique_lock<std::mutex> l (m);
+	while (!stopping) {
+	    l.unlock ();
+	    try {
+		run_once ();
+	    } catch (const std::exception& e) {
+		log_line ().field ("op", "compact") << "compaction: " << e;
+	    }
+	    l.lock ();
+	    cv.wait_for (l, cfg.interval, [this] { return stopping; });
+	}
+    });
+    pthread_sigmask (SIG_SETMASK, &old, nullptr);
+}
+
+void compactor::stop () {
+    {
+	std::lock_guard<std::mutex> l (m);
+	stopping = true;
+    }
+    cv.notify_all ();
+    if (thread.joinable ())
+	thread.join ();
+}
+
+compaction_stats compactor::run_once () {
+    lower_priority ();
+    stats = compaction_stats ();
+    budget = cfg.rate;
+    budget_time = std::chrono::steady_clock::now ();
+
+    std::string lock_path = join (cfg.dir, lock_name);
+    unique_fd lock (posix_check (::open (lock_path.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0666), lock_path));
+    if (flock (lock.get (), LOCK_EX | LOCK_NB) < 0) {
+	if (errno == EWOULDBLOCK)
+	    return stats;       // another process is compacting
+	posix_check (-1, lock_path);
+    }
+
+    // Everything but the newest raw segment, which is being appended to.
+    auto candidates = [this] {
+	auto segs = list_segments (cfg.dir);
+	auto active = std::find_if (segs.rbegin (), segs.rend (), [](const segment_info& s) {
+	    return s.kind == segment_raw;
+	});
+	if (active != segs.rend ())
+	    segs.erase (std::next (active).base ());
+	return segs;
+    };
+
+    try {
+	recover ();
+	int64_t now = now_ns ();
+	if (cfg.retention.count ()) {
+	    auto segs = candidates ();
+	    expire (segs, now);
+	}
+	if (cfg.rollup_after.count ()) {
+	    auto segs = candidates ();
+	    roll_up (segs, now);
+	}
+	auto segs = candidates ();
+	merge (segs);
+    } catch (const cancelled&) {
+    }
+    return stats;
+}
+
+// Finishes or discards a replacement interrupted by a crash.
+void compactor::recover () {
+    std::string tmp = join (cfg.dir, tmp_name);
+    std::string intent = join (cfg.dir, intent_name);
+    std::ifstream in (intent);
+    if (in) {
+	// The intent is only written once the new segment is complete, so
+	// the replacement can always be rolled forward.
+	std::string final_name, name;
+	std::getline (in, final_name);
+	if (::access (tmp.c_str (), F_OK) == 0)
+	    posix_check (::rename (tmp.c_str (), join (cfg.dir, final_name).c_str ()), tmp);
+	while (std::getline (in, name))
+	    if (name != final_name)
+		unlink_if_present (join (cfg.dir, name));
+	fsync_dir (cfg.dir);
+	unlink_if_present (intent);
+    }
+    unlink_if_present (tmp);
+    unlink_if_present (join (cfg.dir, intent_tmp_name));
+
+    // Writers' private files left behind by a crash while creating a segment.
+    unique_dir d (opendir (cfg.dir.c_str ()));
+    if (!d)
+	posix_check (-1, cfg.dir);
+    time_t cutoff = time (nullptr) - 3600;
+    while (dirent* e = readdir (d.get ())) {
+	struct stat st;
+	std::string path = join (cfg.dir, e->d_name);
+	if (std::strncmp (e->d_name, ".raw-", 5) == 0 && stat (path.c_str (), &st) == 0 && st.st_mtime < cutoff)
+	    ::unlink (path.c_str ());
+    }
+}
+
+// Retention works in whole segments: one is deleted once its newest data
+// has expired.
+void compactor::expire (std::vector<segment_info>& segs, int64_t now) {
+    int64_t cutoff = now - cfg.retention.count ();
+    for (const auto& s: segs) {
+	if (s.last_time >= cutoff)
+	    continue;
+	unique_fd fd = lock_segment (s);
+	if (!fd)
+	    continue;
+	posix_check (::unlink (s.path.c_str ()), s.path);
+	++stats.expired;
+    }
+}
+
+void compactor::roll_up (std::vector<segment_info>& segs, int64_t now) {
+    int64_t cutoff = now - cfg.rollup_after.count ();
+    int64_t width = cfg.rollup_width.count ();
+
+    // Only a run of the oldest raw segments is rolled up, so raw data never
+    // sits behind a rollup and merged rollups cannot hide it.
+    std::vector<segment_info> sources;
+    std::vector<unique_fd> fds;
+    for (const auto& s: segs) {
+	if (s.kind != segment_raw)
+	    continue;
+	if (s.last_time >= cutoff)
+	    break;
+	unique_fd fd = lock_segment (s);
+	if (!fd)
+	    break;
+	sources.push_back (s);
+	fds.push_back (std::move (fd));
+    }
+    if (sources.empty ())
+	return;
+
+    std::map<std::tuple<int64_t, uint16_t, uint8_t>, rollup> buckets;
+    std::vector<sample> buf (4096);
+    int64_t last_time = sources.front ().last_time;
+    for (size_t i = 0; i < sources.size (); ++i) {
+	last_time = std::max (last_time, sources[i].last_time);
+	size_t n;
+	for (size_t at = 0; (n = read_records (fds[i].get (), sources[i], at, buf.data (), buf.size ())); at += n) {
+	    throttle (n * sizeof (sample));
+	    for (size_t j = 0; j < n; ++j) {
+		const sample& x = buf[j];
+		int64_t start = x.time - ((x.time % width) + width) % width;
+		rollup& r = buckets.emplace (std::make_tuple (start, x.device, x.channel),
+		    rollup {start, x.device, x.channel, 0, 0, INT32_MAX, INT32_MIN, 0}).first->second;
+		if (x.flags & sample_invalid) {
+		    r.flags |= sample_invalid;
+		    continue;
+		}
+		++r.count;
+		r.min = std::min (r.min, x.value);
+		r.max = std::max (r.max, x.value);
+		r.sum += x.value;
+	    }
+	}
+    }
+
+    std::vector<char> records;
+    records.reserve (buckets.size () * sizeof (rollup));
+    for (const auto& b: buckets) {
+	const char* p = reinterpret_cast<const char*> (&b.second);
+	records.insert (records.end (), p, p + sizeof (rollup));
+    }
+
+    segment_header h = make_header (segment_rollup);
+    h.compacted = 1;
+    h.rollup_width = width;
+    h.first_time = sources.front ().first_time;
+    h.last_time = last_time;
+    replace (sources, segment_name (segment_rollup, h.first_time), h, records);
+    stats.rolled_up += sources.size ();
+}
+
+void compactor::merge (std::vector<segment_info>& segs) {
+    for (size_t i = 0; i < segs.size ();) {
+	// a run of small segments of the same kind and bucket width
+	size_t j = i;
+	off_t total = 0;
+	while (j < segs.size () && segs[j].kind == segs[i].kind
+	    && segs[j].header.rollup_width == segs[i].header.rollup_width
+	    && segs[j].size < cfg.merge_below && total + segs[j].size <= cfg.segment_bytes) {
+	    total += segs[j].size;
+	    ++j;
+	}
+
+	std::vector<segment_info> sources;
+	std::vector<unique_fd> fds;
+	for (size_t k = i; k < j; ++k) {
+	    unique_fd fd = lock_segment (segs[k]);
+	    if (!fd)
+		break;
+	    sources.push_back (segs[k]);
+	    fds.push_back (std::move (fd));
+	}
+	i = std::max (j, i + 1);
+	if (sources.size () < 2)
+	    continue;
+
+	std::vector<char> records;
+	int64_t last_time = sources.front ().last_time;
+	for (size_t k = 0; k < sources.size (); ++k) {
+	    size_t rs = sources[k].header.record_size;
+	    size_t at = records.size ();
+	    records.resize (at + sources[k].records () * rs);
+	    size_t n = read_records (fds[k].get (), sources[k], 0, &records[at], sources[k].records ());
+	    records.resize (at + n * rs);
+	    throttle (n * rs);
+	    last_time = std::max (last_time, sources[k].last_time);
+	}
+
+	segment_header h = sources.front ().header;
+	h.compacted = 1;
+	h.first_time = sources.front ().first_time;
+	h.last_time = last_time;
+	replace (sources, segment_name (sources.front ().kind, h.first_time), h, records);
+	stats.merged += sources.size ();
+    }
+}
+
+// Atomically swaps the source segments for a new one. The caller holds the
+// sources' exclusive locks until this returns.
+void compactor::replace (const std::vector<segment_info>& sources, const std::string& final_name,
+    const segment_header& h, const std::vector<char>& records)
+{
+    std::string tmp = join (cfg.dir, tmp_name);
+    {
+	unique_fd fd (posix_check (::open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666), tmp));
+	write_all (fd.get (), &h, sizeof h, tmp);
+	const size_t chunk = 64 << 10;
+	for (size_t at = 0; at < records.size (); at += chunk) {
+	    size_t n = std::min (chunk, records.size () - at);
+	    throttle (n);
+	    write_all (fd.get (), &records[at], n, tmp);
+	}
+	posix_check (::fsync (fd.get ()), tmp);
+    }
+
+    // Once the intent is on disk, recover() rolls the replacement forward
+    // if we crash part way through deleting the sources.
+    std::string intent = join (cfg.dir, intent_name);
+    std::string intent_tmp = join (cfg.dir, intent_tmp_name);
+    {
+	std::string text = final_name + '\n';
+	for (const auto& s: sources)
+	    text += s.path.substr (s.path.rfind ('/') + 1) + '\n';
+	unique_fd fd (posix_check (::open (intent_tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666), intent_tmp));
+	write_all (fd.get (), text.data (), text.size (), intent_tmp);
+	posix_check (::fsync (fd.get ()), intent_tmp);
+    }
+    posix_check (::rename (intent_tmp.c_str (), intent.c_str ()), intent);
+    fsync_dir (cfg.dir);
+
+    std::string final_path = join (cfg.dir, final_name);
+    posix_check (::rename (tmp.c_str (), final_path.c_str ()), final_path);
+    for (const auto& s: sources)
+	if (s.path != final_path)
+	    unlink_if_present (s.path);
+    fsync_dir (cfg.dir);
+    unlink_if_present (intent);
+}
+
+void compactor::throttle (size_t bytes) {
+    stats.bytes += bytes;
+    std::unique_lock<std::mutex> l (m);
+    if (cfg.rate) {
+	// token bucket holding at most one second's worth of I/O
+	auto now = std::chrono::steady_clock::now ();
+	budget = std::min (double (cfg.rate),
+	    budget + cfg.rate * std::chrono::duration<double> (now - budget_time).count ());
+	budget_time = now;
+	budget -= bytes;
+	if (budget < 0)
+	    cv.wait_for (l, std::chrono::duration<double> (-budget / cfg.rate), [this] { return stopping; });
+    }
+    if (stopping)
+	throw cancelled ();
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,146 @@
+#ifndef TEMPER_HISTORY_H
+#define TEMPER_HISTORY_H
+
+// On-disk sample history.
+//
+// A history directory holds segment files named "<kind>-<first time>.seg".
+// Raw segments hold sample records in arrival order; rollup segments hold
+// per-bucket aggregates produced by the compactor. The newest raw segment
+// is the one being appended to and is never touched by compaction.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "posix.h"
+#include "sample.h"
+
+struct history_config {
+    std::string dir;
+    std::chrono::nanoseconds retention {0};       // zero keeps everything
+    std::chrono::nanoseconds rollup_after {0};    // zero never downsamples
+    std::chrono::nanoseconds rollup_width {std::chrono::minutes (1)};
+    std::chrono::nanoseconds interval {std::chrono::minutes (10)};
+    off_t segment_bytes = 1 << 20;                // raw segments rotate here
+    off_t merge_below = 64 << 10;                 // smaller segments are merged
+    size_t rate = 1 << 20;                        // compaction I/O, bytes/s
+};
+
+enum segment_kind: uint8_t {
+    segment_raw    = 1,
+    segment_rollup = 2
+};
+
+struct segment_header {
+    char magic[4];              // "TMPS"
+    uint8_t version;
+    uint8_t kind;               // segment_kind
+    uint8_t big_endian;         // byte order of everything that follows
+    uint8_t compacted;          // written by the compactor
+    uint32_t record_size;
+    uint32_t reserved;
+    int64_t rollup_width;       // nanoseconds per bucket, rollups only
+    int64_t first_time;         // time range of the source data; only
+    int64_t last_time;          //  meaningful for compacted segments
+    char pad[24];
+};
+static_assert (sizeof (segment_header) == 64, "segment_header is stored on disk as-is");
+
+// One bucket of a rollup segment.
+struct rollup {
+    int64_t start;              // bucket start, nanoseconds since the epoch
+    uint16_t device;
+    uint8_t channel;
+    uint8_t flags;              // sample_invalid if any input was invalid
+    uint32_t count;             // valid samples aggregated
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+};
+static_assert (sizeof (rollup) == 32, "rollup is stored on disk as-is");
+
+struct segment_info {
+    std::string path;
+    segment_kind kind;
+    segment_header header;
+    int64_t first_time;
+    int64_t last_time;
+    off_t size;
+
+    size_t records () const {
+	return (size - sizeof (segment_header)) / header.record_size;
+    }
+};
+
+// Valid segments of a history directory, oldest first.
+std::vector<segment_info> list_segments (const std::string& dir);
+
+// Reads up to n records of a segment starting at record index first;
+// returns the number read.
+size_t read_records (int fd, const segment_info& seg, size_t first, void* out, size_t n);
+
+class history_writer {
+public:
+    explicit history_writer (history_config cfg);
+
+    void append (const sample* s, size_t n);
+    void append (const sample& s) { append (&s, 1); }
+
+private:
+    void open_segment (int64_t time);
+
+    history_config cfg;
+    unique_fd fd;
+};
+
+struct compaction_stats {
+    size_t merged = 0;          // segments merged into a larger one
+    size_t rolled_up = 0;       // raw segments replaced by rollups
+    size_t expired = 0;         // segments deleted by retention
+    size_t bytes = 0;           // bytes read and written
+};
+
+// Merges small segments, downsamples old raw data into rollups and deletes
+// data past retention. Passes run at idle I/O priority and are throttled to
+// cfg.rate, either on the caller's thread (run_once) or on a background
+// thread every cfg.interval (start/stop).
+class compactor {
+public:
+    explicit compactor (history_config cfg);
+    ~compactor ();
+
+    compaction_stats run_once ();
+    void start ();
+    void stop ();
+
+private:
+    struct cancelled {};
+
+    void recover ();
+    void expire (std::vector<segment_info>& segs, int64_t now);
+    void roll_up (std::vector<segment_info>& segs, int64_t now);
+    void merge (std::vector<segment_info>& segs);
+    void replace (const std::vector<segment_info>& sources, const std::string& final_name,
+	const segment_header& h, const std::vector<char>& records);
+    void throttle (size_t bytes);
+
+    history_config cfg;
+    compaction_stats stats;
+    std::chrono::steady_clock::time_point budget_time;
+    double budget = 0;
+
+    std::thread thread;
+    std::mutex m;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,320 @@
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "posix.h"
+
+namespace {
+
+// One line in the ring. seq is the bounded queue's turnstile, after
+// Vyukov: a producer may fill the slot when seq equals its position, the
+// flusher may read it when seq is one past, and hands it back by adding
+// the ring's size.
+struct slot {
+    std::atomic<size_t> seq;
+    log_level level;
+    uint16_t length;
+    uint16_t fields_length;
+    char text[log_max + 32];            // room for a suppression note
+    char fields[log_fields_max];
+};
+
+const size_t ring_size = 256;
+
+slot ring[ring_size];
+std::atomic<size_t> tail {0};           // next to fill
+size_t head = 0;                        // next to write; the flusher's
+std::atomic<uint64_t> dropped {0};
+std::atomic<uint64_t> written {0};      // lines written, for log_flush ()
+std::atomic<bool> running {false};      // whether a log_thread is
+std::atomic<bool> stopping {false};
+
+// The flusher's wake-up, made by the first log_thread and never closed, so
+// that a producer that saw running just before it changed writes nothing
+// else by mistake.
+int wake_fd () {
+    static const int fd = posix_check (eventfd (0, EFD_CLOEXEC), "eventfd");
+    return fd;
+}
+
+// By message hash: 16 bits of tag, 16 of window number and 32 of count.
+std::atomic<uint64_t> recent[64];
+
+struct ring_init {
+    ring_init () {
+	for (size_t i = 0; i < ring_size; ++i)
+	    ring[i].seq.store (i, std::memory_order_relaxed);
+    }
+} init;
+
+// Whether stderr is the journal stream that systemd connected, as
+// JOURNAL_STREAM's "DEVICE:INODE" says. A process whose stderr was then
+// redirected elsewhere inherits the variable all the same.
+bool stderr_is_journal () {
+    const char* v = std::getenv ("JOURNAL_STREAM");
+    unsigned long long dev, ino;
+    int end = 0;
+    struct stat st;
+    return v && std::sscanf (v, "%llu:%llu%n", &dev, &ino, &end) == 2 && !v[end]
+	&& fstat (STDERR_FILENO, &st) == 0 && st.st_dev == dev && st.st_ino == ino;
+}
+
+bool journald () {
+    static const bool j = stderr_is_journal ();
+    return j;
+}
+
+// A datagram socket for the journal's native protocol, made once; -1 if
+// there is none to be had.
+int journal_fd () {
+    static const int fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    return fd;
+}
+
+// The number of earlier copies suppressed, or -1 to suppress this one.
+int64_t rate_limit (std::string_view s, std::string_view fields) {
+    uint32_t h = 2166136261u;
+    for (char c: s)
+	h = (h ^ uint8_t (c)) * 16777619u;
+    for (char c: fields)
+	h = (h ^ uint8_t (c)) * 16777619u;
+    uint64_t tag = h >> 16;
+    uint64_t window = uint64_t (std::chrono::steady_clock::now ().time_since_epoch () / log_window) & 0xffff;
+    std::atomic<uint64_t>& e = recent[h & 63];
+    uint64_t old = e.load (std::memory_order_relaxed), next;
+    int64_t suppressed;
+    do {
+	uint32_t count = uint32_t (old);
+	bool current = (old >> 32 & 0xffff) == window && count;
+	if (current && old >> 48 != tag)
+	    return 0;           // another message has the entry this window
+	if (current) {
+	    next = old + 1;
+	    suppressed = count >= log_burst ? -1 : 0;
+	} else {
+	    next = tag << 48 | window << 32 | 1;
+	    suppressed = old >> 48 == tag && count > log_burst ? count - log_burst : 0;
+	}
+    } while (!e.compare_exchange_weak (old, next, std::memory_order_relaxed));
+    return suppressed;
+}
+
+// Sends a line as a journal entry: PRIORITY, SYSLOG_IDENTIFIER, MESSAGE
+// and the fields with their keys in capitals. False if the journal did not
+// take it.
+bool journal_send (log_level level, std::string_view text, std::string_view fields) {
+    int fd = journal_fd ();
+    if (fd < 0)
+	return false;
+    char entry[64 + sizeof slot::text + log_fields_max];
+    char* p = std::copy_n ("PRIORITY=", 9, entry);
+    *p++ = char ('0' + level);
+    const std::string_view ident = "\nSYSLOG_IDENTIFIER=temper\nMESSAGE=";
+    p = std::copy (ident.begin (), ident.end (), p);
+    p = std::copy (text.begin (), text.end (), p);
+    *p++ = '\n';
+    bool key = true;
+    for (char c: fields) {
+	*p++ = key && c >= 'a' && c <= 'z' ? char (c - 'a' + 'A') : c;
+	key = c == '\n' || (key && c != '=');
+    }
+
+    sockaddr_un a {};
+    a.sun_family = AF_UNIX;
+    std::strcpy (a.sun_path, "/run/systemd/journal/socket");
+    ssize_t r;
+    do
+	r = ::sendto (fd, entry, p - entry, MSG_NOSIGNAL, reinterpret_cast<sockaddr*> (&a), sizeof a);
+    while (r < 0 && errno == EINTR);
+    return r == p - entry;
+}
+
+void write_line (log_level level, const char* text, size_t n, const char* fields = nullptr, size_t fn = 0) {
+    if (journald () && journal_send (level, std::string_view (text, n), std::string_view (fields, fn)))
+	return;
+
+    char line[sizeof slot::text + log_fields_max + 16];
+    char* p = line;
+    if (journald ()) {
+	*p++ = '<';
+	*p++ = char ('0' + level);
+	*p++ = '>';
+    } else {
+	p = std::copy_n ("temper: ", 8, p);
+    }
+    p = std::copy_n (text, n, p);
+    // the key=value lines go on the end, each after a space
+    bool start = true;
+    for (size_t i = 0; i < fn; ++i) {
+	if (start)
+	    *p++ = ' ';
+	start = fields[i] == '\n';
+	if (!start)
+	    *p++ = fields[i];
+    }
+    *p++ = '\n';
+    const char* c = line;
+    while (c != p) {
+	ssize_t r = ::write (STDERR_FILENO, c, p - c);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r < 0)
+	    return;
+	c += r;
+    }
+}
+
+// Writes what is in the ring; the flusher's alone.
+void drain () {
+    for (;;) {
+	slot& s = ring[head % ring_size];
+	if (s.seq.load (std::memory_order_acquire) != head + 1)
+	    break;
+	write_line (s.level, s.text, s.length, s.fields, s.fields_length);
+	s.seq.store (head + ring_size, std::memory_order_release);
+	++head;
+	written.fetch_add (1, std::memory_order_release);
+    }
+    if (uint64_t n = dropped.exchange (0, std::memory_order_relaxed)) {
+	char b[64];
+	char* p = std::copy_n ("log full, ", 10, b);
+	p = std::to_chars (p, b + sizeof b, n).ptr;
+	p = std::copy_n (" lines dropped", 14, p);
+	write_line (log_warning, b, p - b);
+    }
+}
+
+void notify () {
+    uint64_t one = 1;
+    while (::write (wake_fd (), &one, sizeof one) < 0 && errno == EINTR)
+	;
+}
+
+} // namespace
+
+log_line& log_line::operator<< (std::string_view s) {
+    // a line is one line, in the journal too
+    size_t n = std::min (s.size (), log_max - used);
+    std::replace_copy (s.data (), s.data () + n, buf + used, '\n', ' ');
+    used += n;
+    return *this;
+}
+
+log_line& log_line::operator<< (const std::exception& e) {
+    *this << e.what ();
+    if (auto s = dynamic_cast<const std::system_error*> (&e))
+	if (s->code ().category () == std::generic_category () || s->code ().category () == std::system_category ())
+	    field ("errno", s->code ().value ());
+    return *this;
+}
+
+log_line& log_line::field (std::string_view key, std::string_view value) {
+    size_t n = key.size () + 1 + value.size () + 1;
+    if (n > log_fields_max - fields_used)
+	return *this;
+    char* p = std::copy (key.begin (), key.end (), fields + fields_used);
+    *p++ = '=';
+    p = std::replace_copy (value.begin (), value.end (), p, '\n', ' ');
+    *p++ = '\n';
+    fields_used += n;
+    return *this;
+}
+
+log_line::~log_line () {
+    int64_t suppressed = rate_limit (std::string_view (buf, used), std::string_view (fields, fields_used));
+    if (suppressed < 0)
+	return;
+
+    char note[32];
+    size_t noted = 0;
+    if (suppressed) {
+	char* p = std::copy_n (" (", 2, note);
+	p = std::to_chars (p, note + sizeof note, suppressed).ptr;
+	p = std::copy_n (" more)", 6, p);
+	noted = p - note;
+    }
+
+    if (!running.load (std::memory_order_acquire)) {
+	char line[sizeof slot::text];
+	std::memcpy (line, buf, used);
+	std::memcpy (line + used, note, noted);
+	write_line (level, line, used + noted, fields, fields_used);
+	return;
+    }
+
+    size_t pos = tail.load (std::memory_order_relaxed);
+    slot* s;
+    for (;;) {
+	s = &ring[pos % ring_size];
+	intptr_t d = intptr_t (s->seq.load (std::memory_order_acquire)) - intptr_t (pos);
+	if (d == 0 && tail.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed))
+	    break;
+	if (d < 0) {
+	    dropped.fetch_add (1, std::memory_order_relaxed);
+	    return;
+	}
+	if (d > 0)
+	    pos = tail.load (std::memory_order_relaxed);
+    }
+    s->level = level;
+    std::memcpy (s->text, buf, used);
+    std::memcpy (s->text + used, note, noted);
+    s->length = used + noted;
+    std::memcpy (s->fields, fields, fields_used);
+    s->fields_length = fields_used;
+    s->seq.store (pos + 1, std::memory_order_release);
+    notify ();
+}
+
+log_thread::log_thread () {
+    int fd = wake_fd ();
+    stopping.store (false);
+    sigset_t all, old;
+    sigfillset (&all);
+    pthread_sigmask (SIG_BLOCK, &all, &old);
+    thread = std::thread ([fd] {
+	for (;;) {
+	    uint64_t n;
+	    ssize_t r = ::read (fd, &n, sizeof n);
+	    if (r < 0 && errno == EINTR)
+		continue;
+	    drain ();
+	    if (stopping.load (std::memory_order_acquire))
+		return;
+	}
+    });
+    pthread_sigmask (SIG_SETMASK, &old, nullptr);
+    running.store (true, std::memory_order_release);
+}
+
+log_thread::~log_thread () {
+    running.store (false, std::memory_order_release);
+    stopping.store (true, std::memory_order_release);
+    notify ();
+    thread.join ();
+    // lines from producers that saw it running just before it stopped
+    drain ();
+}
+
+void log_flush () {
+    size_t target = tail.load (std::memory_order_acquire);
+    while (written.load (std::memory_order_acquire) < target && running.load (std::memory_order_acquire))
+	std::this_thread::sleep_for (std::chrono::milliseconds (1));
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,104 @@
+#ifndef TEMPER_LOG_H
+#define TEMPER_LOG_H
+
+// Diagnostics for stderr that never wait for it.
+//
+// A log_line is formatted into a buffer of its own and, when it goes,
+// copied into a fixed ring that any thread may add to without a lock. A
+// log_thread writes the ring out. If stderr is slow (a full journald pipe,
+// say) and the ring fills up, further lines are dropped and counted rather
+// than the caller waiting. A line repeated more than log_burst times in
+// log_window is suppressed, and the next copy to get through says how many
+// were. Lines that do not fit in log_max are cut short.
+//
+// A line may carry fields, such as the device it is about, for tools to
+// filter on. On stderr they follow the text as key=value; under journald
+// (JOURNAL_STREAM naming stderr's device and inode) the line goes to the
+// journal's native socket, with its level as PRIORITY and each field as a
+// journal field of its own, DEVICE=1-2 and so on, as sd_journal_send ()
+// would send them. If that fails, the line goes to stderr starting with
+// its level as a syslog priority, <3> for log_err and so on, as
+// sd-daemon(3) describes; otherwise lines start "temper: ". With no
+// log_thread running, before one starts or after it stops, lines are
+// written straight away.
+
+#include <chrono>
+#include <charconv>
+#include <cstddef>
+#include <exception>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+enum log_level {                // syslog priorities
+    log_err = 3,
+    log_warning = 4,
+    log_info = 6
+};
+
+const size_t log_max = 240;
+const size_t log_fields_max = 96;
+const unsigned log_burst = 5;
+const std::chrono::seconds log_window {10};
+
+class log_line {
+public:
+    explicit log_line (log_level level = log_err): level (level) {}
+    ~log_line ();
+    log_line (const log_line&) = delete;
+    log_line& operator= (const log_line&) = delete;
+
+    log_line& operator<< (std::string_view s);
+    log_line& operator<< (const char* s) { return *this << std::string_view (s); }
+    log_line& operator<< (char c) { return *this << std::string_view (&c, 1); }
+
+    template <typename T>
+    std::enable_if_t<std::is_integral_v<T>, log_line&> operator<< (T n) {
+	char b[24];
+	return *this << std::string_view (b, std::to_chars (b, b + sizeof b, n).ptr - b);
+    }
+
+    // e.what (), and for a std::system_error its error number, as the
+    // field errno.
+    log_line& operator<< (const std::exception& e);
+
+    // Keys are lowercase letters, digits and underscores. Fields that do
+    // not fit in log_fields_max are left out.
+    log_line& field (std::string_view key, std::string_view value);
+    log_line& field (std::string_view key, const char* value) { return field (key, std::string_view (value)); }
+
+    template <typename T>
+    std::enable_if_t<std::is_integral_v<T>, log_line&> field (std::string_view key, T n) {
+	char b[24];
+	return field (key, std::string_view (b, std::to_chars (b, b + sizeof b, n).ptr - b));
+    }
+
+private:
+    log_level level;
+    char buf[log_max];
+    size_t used = 0;
+    char fields[log_fields_max];        // key=value lines
+    size_t fields_used = 0;
+};
+
+// Writes queued lines to stderr until it goes, and then the rest. The
+// thread runs with all signals blocked; start it before realtime_enter (),
+// so that it keeps the process's own scheduling.
+class log_thread {
+public:
+    log_thread ();
+    ~log_thread ();
+    log_thread (const log_thread&) = delete;
+    log_thread& operator= (const log_thread&) = delete;
+
+private:
+    std::thread thread;
+};
+
+// Waits until the lines queued so far are written, for output that must
+// come after them.
+void log_flush ();
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
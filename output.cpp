@@ -0,0 +1,180 @@
+#include "output.h"
+
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#include "posix.h"
+
+namespace {
+
+// longest formatted sample, with room to spare
+const size_t max_record = 160;
+
+char* put (char* p, const char* s) {
+    size_t n = std::strlen (s);
+    std::memcpy (p, s, n);
+    return p + n;
+}
+
+template <typename T>
+char* put_int (char* p, T v) {
+    return std::to_chars (p, p + 24, v).ptr;
+}
+
+// digits zero-padded to width
+char* put_fraction (char* p, uint64_t v, int width) {
+    for (int i = width - 1; i >= 0; --i, v /= 10)
+	p[i] = '0' + v % 10;
+    return p + width;
+}
+
+// seconds since the epoch, to the millisecond
+char* put_time (char* p, int64_t ns) {
+    uint64_t mag = ns;
+    if (ns < 0) {
+	*p++ = '-';
+	mag = -uint64_t (ns);
+    }
+    uint64_t ms = mag / 1000000;
+    p = put_int (p, ms / 1000);
+    *p++ = '.';
+    return put_fraction (p, ms % 1000, 3);
+}
+
+} // namespace
+
+output_format parse_output_format (const std::string& s) {
+    if (s == "plain")
+	return format_plain;
+    if (s == "csv")
+	return format_csv;
+    if (s == "json")
+	return format_json;
+    if (s == "binary")
+	return format_binary;
+    throw std::runtime_error ("unknown output format: " + s);
+}
+
+sample_output::sample_output (int fd, output_format format, int decimals):
+    fd (fd),
+    format (format),
+    decimals (decimals),
+    buf (64 << 10)
+{
+    if (decimals < 0 || decimals > 3)
+	throw std::runtime_error ("decimals must be between 0 and 3");
+}
+
+sample_output::~sample_output () {
+    try {
+	flush ();
+    } catch (const std::exception&) {
+    }
+}
+
+const char* sample_output::channel_name (uint8_t c) const {
+    switch (c) {
+    case channel_inner:         return "inner";
+    case channel_outer:         return "outer";
+    case channel_humidity:      return "humidity";
+    }
+    if (c >= channel_derived && size_t (c - channel_derived) < derived_names.size ())
+	return derived_names[c - channel_derived].c_str ();
+    return "unknown";
+}
+
+// v is in thousandths; rounded half away from zero to the decimals kept
+char* sample_output::put_value (char* p, int32_t v) const {
+    static const int64_t scale[] = {1000, 100, 10, 1};
+    int64_t div = scale[decimals];
+    int64_t mag = v < 0 ? -int64_t (v) : v;
+    mag = (mag + div / 2) / div;
+    if (v < 0 && mag)
+	*p++ = '-';
+    int64_t unit = 1000 / div;
+    p = put_int (p, mag / unit);
+    if (decimals) {
+	*p++ = '.';
+	p = put_fraction (p, mag % unit, decimals);
+    }
+    return p;
+}
+
+bool sample_output::room () const {
+    return buf.size () - used >= max_record + sizeof (sample);
+}
+
+void sample_output::write (const sample& s) {
+    if (!room ())
+	flush ();
+
+    char* p = &buf[used];
+    switch (format) {
+    case format_plain:
+	p = put_value (p, s.value);
+	*p++ = '\n';
+	break;
+
+    case format_csv:
+	if (!header) {
+	    p = put (p, "time,device,channel,value,flags\n");
+	    header = true;
+	}
+	p = put_time (p, s.time);
+	*p++ = ',';
+	p = put_int (p, s.device);
+	*p++ = ',';
+	p = put (p, channel_name (s.channel));
+	*p++ = ',';
+	p = put_value (p, s.value);
+	*p++ = ',';
+	p = put_int (p, unsigned (s.flags));
+	*p++ = '\n';
+	break;
+
+    case format_json:
+	p = put (p, "{\"time\":");
+	p = put_time (p, s.time);
+	p = put (p, ",\"device\":");
+	p = put_int (p, s.device);
+	p = put (p, ",\"channel\":\"");
+	p = put (p, channel_name (s.channel));
+	p = put (p, "\",\"value\":");
+	p = put_value (p, s.value);
+	p = put (p, ",\"flags\":");
+	p = put_int (p, unsigned (s.flags));
+	p = put (p, "}\n");
+	break;
+
+    case format_binary:
+	std::memcpy (p, &s, sizeof s);
+	p += sizeof s;
+	break;
+    }
+    used = p - buf.data ();
+}
+
+void sample_output::flush () {
+    size_t n = used;
+    used = 0;
+    write_all (fd, buf.data (), n, "output");
+}
+
+bool sample_output::try_flush () {
+    size_t sent = 0;
+    while (sent < used) {
+	ssize_t r = ::write (fd, buf.data () + sent, used - sent);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    break;
+	sent += posix_check (r, "output");
+    }
+    // keep the rest at the front, so that the space sent is free again
+    std::memmove (buf.data (), buf.data () + sent, used - sent);
+    used -= sent;
+    return used == 0;
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,72 @@
+#ifndef TEMPER_OUTPUT_H
+#define TEMPER_OUTPUT_H
+
+// Formatting of samples for stdout and other streams.
+//
+// Numbers are formatted with std::to_chars into a reused buffer, with a
+// fixed number of decimals and no locale, and the buffer goes out with one
+// write(2) per flush rather than through iostreams.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sample.h"
+
+enum output_format {
+    format_plain,       // the value alone
+    format_csv,         // time,device,channel,value,flags with a header
+    format_json,        // one JSON object per line
+    format_binary       // sample records as stored in history segments
+};
+
+output_format parse_output_format (const std::string& s);
+
+class sample_output {
+public:
+    // decimals is how many digits of the thousandths stored in a sample to
+    // keep, 0 to 3.
+    sample_output (int fd, output_format format, int decimals = 3);
+    ~sample_output ();
+    sample_output (const sample_output&) = delete;
+    sample_output& operator= (const sample_output&) = delete;
+
+    // Names derived channel channel_derived + k in text formats; see
+    // expr.h. Unnamed channels are "unknown".
+    void name_channels (const std::vector<std::string>& derived) { derived_names = derived; }
+
+    // Buffers one sample, flushing first if the buffer is full.
+    void write (const sample& s);
+
+    // Writes out everything buffered. Throws std::system_error on failure,
+    // EPIPE included.
+    void flush ();
+
+    // For non-blocking descriptors: writes what the descriptor takes now
+    // and keeps the rest. Returns true once nothing is pending. write ()
+    // still flushes a full buffer with flush (), which fails with EAGAIN
+    // if the descriptor is not keeping up; check room () first to avoid
+    // that.
+    bool try_flush ();
+
+    size_t pending () const { return used; }
+
+    // Whether write () can buffer another sample without flushing.
+    bool room () const;
+
+private:
+    char* put_value (char* p, int32_t v) const;
+    const char* channel_name (uint8_t c) const;
+
+    int fd;
+    output_format format;
+    int decimals;
+    bool header = false;
+    std::vector<std::string> derived_names;
+    std::vector<char> buf;
+    size_t used = 0;
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,60 @@
+#ifndef TEMPER_POSIX_H
+#define TEMPER_POSIX_H
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <unistd.h>
+
+// Throws std::system_error for a failed system call, keeping errno.
+template <typename T>
+T posix_check (T r, const char* what) {
+    if (r < 0)
+	throw std::system_error (errno, std::generic_category (), what);
+    return r;
+}
+
+template <typename T>
+T posix_check (T r, const std::string& what) {
+    return posix_check (r, what.c_str ());
+}
+
+// write(2) until everything is out; for blocking descriptors.
+inline void write_all (int fd, const void* p, size_t n, const std::string& what) {
+    const char* c = static_cast<const char*> (p);
+    while (n) {
+	ssize_t r = ::write (fd, c, n);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	posix_check (r, what);
+	c += r;
+	n -= r;
+    }
+}
+
+struct unique_fd {
+    int fd;
+
+    explicit unique_fd (int fd = -1): fd (fd) {}
+    unique_fd (unique_fd&& o) noexcept: fd (std::exchange (o.fd, -1)) {}
+    unique_fd& operator= (unique_fd&& o) noexcept {
+	reset (std::exchange (o.fd, -1));
+	return *this;
+    }
+    ~unique_fd () { reset (); }
+
+    int get () const { return fd; }
+    explicit operator bool () const { return fd >= 0; }
+
+    void reset (int n = -1) {
+	if (fd >= 0)
+	    ::close (fd);
+	fd = n;
+    }
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
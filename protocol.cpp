@@ -0,0 +1,91 @@
+#include "protocol.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+short_report::short_report (size_t size, size_t needed):
+    std::runtime_error ("short report: " + std::to_string (size) + " bytes, "
+	+ std::to_string (needed) + " needed")
+{}
+
+void report_view::require (size_t n) const {
+    if (bytes.size () < n)
+	throw short_report (bytes.size (), n);
+}
+
+namespace {
+
+std::span<unsigned char> reply_span (const report_transport& t, msg256& buf) {
+    return std::span<unsigned char> (buf).first (std::min (t.report_size, buf.size ()));
+}
+
+} // namespace
+
+size_t hid_report_size (std::span<const unsigned char> d) {
+    // Short items only: a prefix byte of tag, type and data length, then
+    // up to four bytes of little-endian data.
+    uint64_t item_bits = 0, count = 0, input = 0, feature = 0;
+    for (size_t i = 0; i < d.size (); ) {
+	unsigned char prefix = d[i];
+	if (prefix == 0xfe)                     // a long item, never seen in practice
+	    return 0;
+	size_t n = prefix & 3;
+	if (n == 3)
+	    n = 4;
+	if (i + 1 + n > d.size ())
+	    return 0;
+	uint32_t data = 0;
+	for (size_t j = 0; j < n; ++j)
+	    data |= uint32_t (d[i + 1 + j]) << 8 * j;
+	switch (prefix & 0xfc) {
+	case 0x74: item_bits = data; break;     // Report Size
+	case 0x94: count = data; break;         // Report Count
+	case 0x84: return 0;                    // Report ID
+	case 0x80: input += item_bits * count; break;
+	case 0xb0: feature += item_bits * count; break;
+	}
+	i += 1 + n;
+    }
+    return (std::max (input, feature) + 7) / 8;
+}
+
+const frame_table& frames_for (unsigned char cmd) {
+    switch (cmd) {
+    case cmd_getdata_ntc:       return frames<cmd_getdata_ntc>;
+    case cmd_reset0:            return frames<cmd_reset0>;
+    case cmd_reset1:            return frames<cmd_reset1>;
+    case cmd_getdata:           return frames<cmd_getdata>;
+    case cmd_devtype:           return frames<cmd_devtype>;
+    case cmd_getdata_outer:     return frames<cmd_getdata_outer>;
+    case cmd_getdata_inner:     return frames<cmd_getdata_inner>;
+    default:                    throw std::invalid_argument ("unknown command");
+    }
+}
+
+void send_cmd (report_transport& t, unsigned char cmd) {
+    const frame_table& f = frames_for (cmd);
+    for (size_t i = 0; i < command_frames; ++i)
+	t.send (f[i]);
+}
+
+report_view read_data (report_transport& t, unsigned char cmd, msg256& buf) {
+    for (const msg32& b: frames_for (cmd))
+	t.send (b);
+    return report_view (std::span<const unsigned char> (buf.data (), t.recv (reply_span (t, buf))));
+}
+
+task<> send_cmd_co (report_transport& t, unsigned char cmd) {
+    const frame_table& f = frames_for (cmd);
+    for (size_t i = 0; i < command_frames; ++i)
+	co_await t.send_co (f[i]);
+}
+
+task<report_view> read_data_co (report_transport& t, unsigned char cmd, msg256& buf) {
+    for (const msg32& b: frames_for (cmd))
+	co_await t.send_co (b);
+    size_t n = co_await t.recv_co (reply_span (t, buf));
+    co_return report_view (std::span<const unsigned char> (buf.data (), n));
+}
+
+// vim: ts=8 sts=4 sw=4 et
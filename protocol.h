@@ -0,0 +1,189 @@
+#ifndef TEMPER_PROTOCOL_H
+#define TEMPER_PROTOCOL_H
+
+// The TEMPer report protocol, apart from how the reports travel.
+//
+// A command is a header report, a report carrying the command byte and
+// seven reports of i2c bus padding. A data request report then asks for
+// the reply to the last command, which comes back as one report of up to
+// 256 bytes, received into the caller's buffer and read in place through
+// the views below. Only as much is asked for as the device's reports
+// hold, which for a TEMPer1 is 8 bytes.
+// Every command's reports are built at compile time, in frame_table
+// constants, and sent from there. A report_transport moves the reports:
+// over USB control transfers, or to a simulated device (sim.h), which
+// checks them against the same tables.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+
+#include "health.h"
+#include "task.h"
+
+typedef std::array<unsigned char, 32> msg32;
+typedef std::array<unsigned char, 256> msg256;
+
+enum cmds {
+    cmd_getdata_ntc   = 0x41,
+    cmd_reset0	      = 0x43,
+    cmd_reset1	      = 0x44,
+    cmd_getdata       = 0x48,
+    cmd_devtype       = 0x52,
+    cmd_getdata_outer = 0x53,
+    cmd_getdata_inner = 0x54
+};
+
+enum dev_types {
+    dev_type_temperhum	= 0x5a53,
+    dev_type_temperhum2 = 0x5a57,
+    dev_type_temper1	= 0x5857,
+    dev_type_temper2	= 0x5957,
+    dev_type_temperntc	= 0x5b57
+};
+
+// hey, here comes a command!
+constexpr msg32 cmd_header = {{0x0a, 0x0b, 0x0c, 0x0d, 0x00, 0x00, 0x02, 0x00}};
+
+// hey, give me the data!
+constexpr msg32 data_request = {{10, 11, 12, 13, 0, 0, 1, 0}};
+
+// A command's reports in the order they are sent: the header, the
+// command, the padding and, to read its reply, the data request.
+typedef std::array<msg32, 10> frame_table;
+constexpr size_t command_frames = 9;            // without the data request
+
+constexpr frame_table make_frame_table (unsigned char cmd) {
+    frame_table t {};
+    t[0] = cmd_header;
+    t[1][0] = cmd;
+    t[command_frames] = data_request;
+    return t;
+}
+
+template <unsigned char Cmd>
+inline constexpr frame_table frames = make_frame_table (Cmd);
+
+static_assert (frames<cmd_getdata_inner>[0] == cmd_header && frames<cmd_getdata_inner>[1][0] == 0x54
+    && frames<cmd_getdata_inner>[8] == msg32 {} && frames<cmd_getdata_inner>[9] == data_request);
+
+// The table for cmd, one of cmds; throws std::invalid_argument for any
+// other byte.
+const frame_table& frames_for (unsigned char cmd);
+
+// What a TEMPer1 declares its reports to be, and answers with.
+constexpr size_t temper1_report_size = 8;
+
+// The longest input or feature report a HID report descriptor declares,
+// in bytes; 0 if the descriptor makes no sense, or numbers its reports,
+// which are then not all alike.
+size_t hid_report_size (std::span<const unsigned char> descriptor);
+
+// A report too short for what was read from it.
+struct short_report: std::runtime_error {
+    short_report (size_t size, size_t needed);
+};
+
+// A received report, bounds-checked. Fields are read in place, in the
+// byte order the device sends them whatever the host's, and a report too
+// short for a field throws rather than yielding garbage.
+class report_view {
+public:
+    explicit report_view (std::span<const unsigned char> bytes): bytes (bytes) {}
+
+    size_t size () const { return bytes.size (); }
+
+    // Throws short_report unless the report has at least n bytes.
+    void require (size_t n) const;
+
+    uint8_t u8 (size_t i) const {
+	require (i + 1);
+	return bytes[i];
+    }
+
+    uint16_t le16 (size_t i) const {
+	require (i + 2);
+	return bytes[i] | bytes[i + 1] << 8;
+    }
+
+    std::span<const unsigned char> sub (size_t i, size_t n) const {
+	require (i + n);
+	return bytes.subspan (i, n);
+    }
+
+private:
+    std::span<const unsigned char> bytes;
+};
+
+// The reply to cmd_devtype.
+class devtype_view {
+public:
+    static constexpr size_t size = 7;
+
+    explicit devtype_view (report_view r): r (r) { r.require (size); }
+
+    uint16_t dev_type () const { return r.le16 (0); }     // dev_types
+    uint8_t cal (unsigned sensor, unsigned i) const { return r.u8 (2 + 2 * sensor + i); }
+
+    // OpenBSD repeatedly issues the devtype command until this != 0x53.
+    // Maybe this is necessary if the device has just been plugged in and
+    // has not settled yet?
+    uint8_t footer () const { return r.u8 (6); }
+
+private:
+    report_view r;
+};
+
+// The reply to cmd_getdata_inner or cmd_getdata_outer: a big-endian word
+// in 1/256 degrees, as decode_temper () takes it.
+class reading_view {
+public:
+    static constexpr size_t size = 2;
+
+    explicit reading_view (report_view r): word (r.sub (0, size)) {}
+
+    const unsigned char* raw () const { return word.data (); }
+
+private:
+    std::span<const unsigned char> word;
+};
+
+class report_transport {
+public:
+    virtual ~report_transport () {}
+
+    // Blocking; throw on failure. recv () receives the reply to the last
+    // data request into buf and gives its length.
+    virtual void send (const msg32& b) = 0;
+    virtual size_t recv (std::span<unsigned char> buf) = 0;
+
+    // The same on an event loop, with whatever drives the transport there
+    // (usb_event_source, sim_bus) attached to it; buf must outlive the
+    // task.
+    virtual task<> send_co (const msg32& b) = 0;
+    virtual task<size_t> recv_co (std::span<unsigned char> buf) = 0;
+
+    // Kept by the transport for its transfers, and by its user for what
+    // it does with them.
+    device_health health;
+
+    // How much of a reply is asked for: the device's report length, where
+    // the transport or the model knows it. Replies may come back shorter;
+    // the views decide whether they are too short.
+    size_t report_size = sizeof (msg256);
+};
+
+// The replies are received into buf, up to t.report_size bytes of it, and
+// the views point into buf.
+void send_cmd (report_transport& t, unsigned char cmd);
+report_view read_data (report_transport& t, unsigned char cmd, msg256& buf);
+
+// t and buf must outlive the tasks.
+task<> send_cmd_co (report_transport& t, unsigned char cmd);
+task<report_view> read_data_co (report_transport& t, unsigned char cmd, msg256& buf);
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,123 @@
+#include "realtime.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <iomanip>
+#include <system_error>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+namespace {
+
+void check (int e, const char* what) {
+    if (e)
+	throw std::system_error (e, std::generic_category (), what);
+}
+
+// Touches a stack's worth of pages now, while they are locked, rather than
+// on the first deep call later.
+void prefault_stack () {
+    volatile unsigned char stack[256 * 1024];
+    for (size_t i = 0; i < sizeof stack; i += 4096)
+	stack[i] = 0;
+}
+
+// What realtime_enter () found, for realtime_leave () to restore. Written
+// before any thread that reads it is started.
+struct saved_scheduling {
+    bool valid = false;
+    int policy;
+    sched_param param;
+    cpu_set_t cpus;
+} saved;
+
+unsigned bucket (uint64_t v) {
+    if (v < 8)
+	return v;
+    unsigned e = 63 - __builtin_clzll (v);
+    return 8 + (e - 3) * 8 + ((v >> (e - 3)) & 7);
+}
+
+uint64_t bucket_floor (unsigned b) {
+    if (b < 8)
+	return b;
+    unsigned e = (b - 8) / 8 + 3;
+    return uint64_t (8 + (b - 8) % 8) << (e - 3);
+}
+
+} // namespace
+
+void realtime_enter (const realtime_config& cfg) {
+    check (pthread_getschedparam (pthread_self (), &saved.policy, &saved.param), "pthread_getschedparam");
+    check (pthread_getaffinity_np (pthread_self (), sizeof saved.cpus, &saved.cpus), "pthread_getaffinity_np");
+    saved.valid = true;
+
+    if (cfg.cpu >= 0) {
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	CPU_SET (cfg.cpu, &set);
+	check (pthread_setaffinity_np (pthread_self (), sizeof set, &set), "pthread_setaffinity_np");
+    }
+
+    sched_param sp {};
+    sp.sched_priority = cfg.priority;
+    check (pthread_setschedparam (pthread_self (), SCHED_FIFO, &sp), "pthread_setschedparam");
+
+    // On fault, so that the untouched parts of other threads' stacks are
+    // not committed; kernels before 4.4 lack it, and lock everything.
+    if (mlockall (MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0
+	    && (errno != EINVAL || mlockall (MCL_CURRENT | MCL_FUTURE) < 0))
+	check (errno, "mlockall");
+    // keep freed memory rather than handing it back to be faulted in again
+    mallopt (M_TRIM_THRESHOLD, -1);
+    mallopt (M_MMAP_MAX, 0);
+    prefault_stack ();
+}
+
+void realtime_leave () {
+    if (!saved.valid)
+	return;
+    pthread_setschedparam (pthread_self (), saved.policy, &saved.param);
+    pthread_setaffinity_np (pthread_self (), sizeof saved.cpus, &saved.cpus);
+}
+
+void jitter_stats::record (int64_t late_ns) {
+    if (late_ns < 0)
+	late_ns = 0;
+    ++hist[bucket (late_ns)];
+    lo = n ? std::min (lo, late_ns) : late_ns;
+    hi = n ? std::max (hi, late_ns) : late_ns;
+    sum += late_ns;
+    ++n;
+}
+
+int64_t jitter_stats::quantile (double q) const {
+    if (!n)
+	return 0;
+    uint64_t rank = uint64_t (q * (n - 1));
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < buckets; ++b) {
+	seen += hist[b];
+	if (seen > rank)
+	    return std::max (lo, std::min (hi, int64_t (bucket_floor (b))));
+    }
+    return hi;
+}
+
+void jitter_stats::report (std::ostream& o) const {
+    auto us = [&o] (int64_t ns) -> std::ostream& {
+	return o << std::fixed << std::setprecision (1) << ns / 1000.0;
+    };
+    o << "reading latency over " << n << " readings (us): min ";
+    us (lo) << ", p50 ";
+    us (quantile (0.5)) << ", p99 ";
+    us (quantile (0.99)) << ", p99.9 ";
+    us (quantile (0.999)) << ", max ";
+    us (hi) << ", mean ";
+    us (mean ()) << '\n';
+}
+
+// vim: ts=8 sts=4 sw=4 et
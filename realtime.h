@@ -0,0 +1,70 @@
+#ifndef TEMPER_REALTIME_H
+#define TEMPER_REALTIME_H
+
+// Real-time scheduling for the acquisition thread, and a record of how
+// late its readings are.
+//
+// Threads inherit scheduling policy and CPU affinity from the thread that
+// creates them. realtime_enter () is therefore meant to be called once the
+// worker pool is running, so that only the acquisition thread, which then
+// does its own transfers, is made real-time; threads started later that
+// must not compete with it, such as sinks and compaction, call
+// realtime_leave () when they start.
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+struct realtime_config {
+    bool enabled = false;
+    int priority = 10;          // SCHED_FIFO, 1 to 99
+    int cpu = -1;               // pin to this CPU; -1 to leave affinity alone
+};
+
+// Pins the calling thread, and no other, gives it SCHED_FIFO at
+// cfg.priority, locks the process's memory as it is touched and
+// pre-faults some stack, so that neither other work nor page faults delay
+// it. Throws std::system_error if the process may not do so (it needs
+// CAP_SYS_NICE and CAP_IPC_LOCK, or the matching rlimits). Call it once,
+// from one thread.
+void realtime_enter (const realtime_config& cfg);
+
+// Gives the calling thread the scheduling policy and CPU affinity that the
+// thread calling realtime_enter () had before, such as a chrt(1) or
+// taskset(1) the process was started under; does nothing if
+// realtime_enter () has not been called. Best effort: a thread may always
+// lower its own priority, so this fails only if the system is out of
+// resources, and then the thread carries on as it was.
+void realtime_leave ();
+
+// How late each reading was, in a log-linear histogram: eight buckets per
+// power of two, so percentiles are within 12.5%. Recording never
+// allocates.
+class jitter_stats {
+public:
+    void record (int64_t late_ns);
+
+    uint64_t count () const { return n; }
+    int64_t min () const { return lo; }
+    int64_t max () const { return hi; }
+    int64_t mean () const { return n ? sum / int64_t (n) : 0; }
+
+    // The lower bound of the bucket holding the q-quantile, 0 <= q <= 1.
+    int64_t quantile (double q) const;
+
+    // One line: count, min, p50, p99, p99.9, max and mean in microseconds.
+    void report (std::ostream& o) const;
+
+private:
+    static const unsigned buckets = 8 + 61 * 8;
+
+    std::array<uint64_t, buckets> hist {};
+    uint64_t n = 0;
+    int64_t sum = 0;
+    int64_t lo = 0;
+    int64_t hi = 0;
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,145 @@
+#include "ring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+const char ring_magic[4] = {'T', 'M', 'P', 'R'};
+
+const bool host_big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+
+size_t ring_length (uint32_t capacity) {
+    return sizeof (ring_header) + size_t (capacity) * sizeof (ring_record);
+}
+
+bool valid_header (const ring_header* h, size_t length) {
+    return length >= sizeof (ring_header)
+	&& std::memcmp (h->magic, ring_magic, sizeof h->magic) == 0
+	&& h->version == 1
+	&& h->big_endian == host_big_endian
+	&& h->record_size == sizeof (ring_record)
+	&& h->capacity > 0
+	&& length >= ring_length (h->capacity);
+}
+
+void* map (int fd, size_t length, int prot, const std::string& path) {
+    void* p = mmap (nullptr, length, prot, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+	posix_check (-1, path);
+    return p;
+}
+
+} // namespace
+
+ring_writer::ring_writer (const std::string& path, uint32_t capacity):
+    h (nullptr),
+    records (nullptr),
+    length (ring_length (capacity))
+{
+    if (!capacity)
+	throw std::runtime_error ("ring capacity must be positive");
+
+    fd = unique_fd (posix_check (::open (path.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0644), path));
+    if (flock (fd.get (), LOCK_EX | LOCK_NB) < 0) {
+	if (errno == EWOULDBLOCK)
+	    throw std::runtime_error (path + ": ring is open by another writer");
+	posix_check (-1, path);
+    }
+
+    struct stat st;
+    posix_check (fstat (fd.get (), &st), path);
+    if (size_t (st.st_size) == length) {
+	h = static_cast<ring_header*> (map (fd.get (), length, PROT_READ | PROT_WRITE, path));
+	if (valid_header (h, length) && h->capacity == capacity) {
+	    records = reinterpret_cast<ring_record*> (h + 1);
+	    return;
+	}
+	munmap (h, length);
+    }
+
+    // Readers may have the old file mapped and would fault if it shrank
+    // under them, so a ring of the wrong shape is replaced, not resized.
+    std::string tmp = path + ".new";
+    unique_fd n (posix_check (::open (tmp.c_str (), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), tmp));
+    posix_check (flock (n.get (), LOCK_EX | LOCK_NB), tmp);
+    posix_check (ftruncate (n.get (), length), tmp);
+    h = static_cast<ring_header*> (map (n.get (), length, PROT_READ | PROT_WRITE, tmp));
+    std::memcpy (h->magic, ring_magic, sizeof h->magic);
+    h->version = 1;
+    h->big_endian = host_big_endian;
+    h->record_size = sizeof (ring_record);
+    h->capacity = capacity;
+    h->head.store (0, std::memory_order_relaxed);
+    posix_check (msync (h, length, MS_SYNC), tmp);
+    posix_check (::rename (tmp.c_str (), path.c_str ()), path);
+    fd = std::move (n);
+    records = reinterpret_cast<ring_record*> (h + 1);
+}
+
+ring_writer::~ring_writer () {
+    munmap (h, length);
+}
+
+void ring_writer::append (const sample& s) {
+    uint64_t n = h->head.load (std::memory_order_relaxed);
+    ring_record& r = records[n % h->capacity];
+    uint64_t w[2];
+    std::memcpy (w, &s, sizeof w);
+
+    r.seq.store (2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_release);
+    r.words[0].store (w[0], std::memory_order_relaxed);
+    r.words[1].store (w[1], std::memory_order_relaxed);
+    r.seq.store (2 * n + 2, std::memory_order_release);
+    h->head.store (n + 1, std::memory_order_release);
+}
+
+ring_reader::ring_reader (const std::string& path) {
+    unique_fd fd (posix_check (::open (path.c_str (), O_RDONLY | O_CLOEXEC), path));
+    struct stat st;
+    posix_check (fstat (fd.get (), &st), path);
+    length = st.st_size;
+    if (length < sizeof (ring_header))
+	throw std::runtime_error (path + ": not a sample ring");
+    h = static_cast<const ring_header*> (map (fd.get (), length, PROT_READ, path));
+    if (!valid_header (h, length)) {
+	munmap (const_cast<ring_header*> (h), length);
+	throw std::runtime_error (path + ": not a sample ring");
+    }
+    records = reinterpret_cast<const ring_record*> (h + 1);
+}
+
+ring_reader::~ring_reader () {
+    munmap (const_cast<ring_header*> (h), length);
+}
+
+size_t ring_reader::recent (sample* out, size_t n) const {
+    uint64_t head = h->head.load (std::memory_order_acquire);
+    uint64_t capacity = h->capacity;
+    n = std::min<uint64_t> ({n, head, capacity});
+
+    size_t copied = 0;
+    for (uint64_t i = head - n; i < head; ++i) {
+	const ring_record& r = records[i % capacity];
+	uint64_t before = r.seq.load (std::memory_order_acquire);
+	uint64_t w[2] = {
+	    r.words[0].load (std::memory_order_relaxed),
+	    r.words[1].load (std::memory_order_relaxed)
+	};
+	std::atomic_thread_fence (std::memory_order_acquire);
+	uint64_t after = r.seq.load (std::memory_order_relaxed);
+	if (before != 2 * i + 2 || after != before)
+	    continue;   // overwritten since we loaded head
+	std::memcpy (&out[copied++], w, sizeof w);
+    }
+    return copied;
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,83 @@
+#ifndef TEMPER_RING_H
+#define TEMPER_RING_H
+
+// Fixed-size memory-mapped ring of recent samples.
+//
+// The file is a ring_header followed by capacity ring_records. The writer
+// fills record n (counting from zero since the file was created) in slot
+// n % capacity and then sets head to n + 1. Each record carries a seqlock:
+// seq is 2n + 1 while record n is being written and 2n + 2 once it is
+// complete, so a reader that sees the same expected even seq before and
+// after copying the words has a consistent sample. Readers need nothing
+// but a read-only mapping; no system calls and no locks.
+//
+// The contents outlive the writer, so a restarted daemon carries on where
+// it stopped and readers keep their history.
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "posix.h"
+#include "sample.h"
+
+struct ring_header {
+    char magic[4];                      // "TMPR"
+    uint8_t version;
+    uint8_t big_endian;
+    uint16_t reserved;
+    uint32_t record_size;
+    uint32_t capacity;
+    std::atomic<uint64_t> head;         // number of complete records written
+    char pad[40];
+};
+static_assert (sizeof (ring_header) == 64, "ring_header is shared as-is");
+
+struct ring_record {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> words[2];     // the sample's bytes
+};
+static_assert (sizeof (ring_record) == 24, "ring_record is shared as-is");
+static_assert (sizeof (ring_record::words) == sizeof (sample), "a sample fills a ring_record");
+static_assert (ATOMIC_LLONG_LOCK_FREE == 2, "the ring is shared between processes");
+
+class ring_writer {
+public:
+    // Opens the ring, creating or resizing it as needed. Only one writer may
+    // have a ring open at a time.
+    ring_writer (const std::string& path, uint32_t capacity);
+    ~ring_writer ();
+    ring_writer (const ring_writer&) = delete;
+    ring_writer& operator= (const ring_writer&) = delete;
+
+    void append (const sample& s);
+
+private:
+    unique_fd fd;
+    ring_header* h;
+    ring_record* records;
+    size_t length;
+};
+
+class ring_reader {
+public:
+    explicit ring_reader (const std::string& path);
+    ~ring_reader ();
+    ring_reader (const ring_reader&) = delete;
+    ring_reader& operator= (const ring_reader&) = delete;
+
+    // Copies out up to n of the most recent samples, oldest first, skipping
+    // any overwritten while we were reading. Returns the number copied.
+    size_t recent (sample* out, size_t n) const;
+
+    uint32_t capacity () const { return h->capacity; }
+
+private:
+    const ring_header* h;
+    const ring_record* records;
+    size_t length;
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,38 @@
+#ifndef TEMPER_SAMPLE_H
+#define TEMPER_SAMPLE_H
+
+#include <chrono>
+#include <cstdint>
+
+enum sample_channel: uint8_t {
+    channel_inner    = 0,
+    channel_outer    = 1,
+    channel_humidity = 2,
+    channel_derived  = 16       // the first derived channel; see expr.h
+};
+
+enum sample_flags: uint8_t {
+    sample_invalid = 0x01,
+    sample_rollup  = 0x02       // the mean of a rollup bucket, in exports
+};
+
+// One decoded reading. This is also the on-disk record format of raw
+// history segments, so its layout must not change.
+struct sample {
+    int64_t time;       // nanoseconds since the epoch
+    uint16_t device;
+    uint8_t channel;    // sample_channel
+    uint8_t flags;      // sample_flags
+    int32_t value;      // millidegrees Celsius, or thousandths of a percent RH
+};
+static_assert (sizeof (sample) == 16, "sample is stored on disk as-is");
+
+// The time for a sample taken now.
+inline int64_t now_ns () {
+    return std::chrono::duration_cast<std::chrono::nanoseconds> (
+	std::chrono::system_clock::now ().time_since_epoch ()).count ();
+}
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,411 @@
+#include "server.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <locale>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "export.h"
+#include "log.h"
+
+struct sample_server::client {
+    unique_fd fd;
+    enum { reading, streaming, flushing, exporting, replying } state = reading;
+    std::string request;
+    std::string reply;                  // what is left to send, when replying
+    std::unique_ptr<sample_output> out;
+    std::unique_ptr<history_export> exp;
+    bool want_out = false;
+
+    // for subscriptions
+    int device = -1;                    // -1 for any
+    int channel = -1;
+    int32_t delta = 0;                  // thousandths, as in sample::value
+    bool drop_slow = false;
+    uint64_t dropped = 0;
+    std::map<std::pair<uint16_t, uint8_t>, sample> last;       // last sent
+
+    bool wants (const sample& s) const {
+	if ((device >= 0 && s.device != device) || (channel >= 0 && s.channel != channel))
+	    return false;
+	if (!delta)
+	    return true;
+	auto l = last.find (std::make_pair (s.device, s.channel));
+	return l == last.end () || (l->second.flags & sample_invalid) != (s.flags & sample_invalid)
+	    || std::abs (int64_t (s.value) - l->second.value) >= delta;
+    }
+
+    void subscribe (const std::vector<std::string>& options);
+};
+
+namespace {
+
+// Most an export sends per wakeup of the loop.
+const uint64_t export_slice = 1 << 20;
+
+// How long accepting pauses for want of descriptors or memory, unless a
+// client goes first.
+const std::chrono::seconds accept_pause {1};
+
+int parse_channel (const std::string& s) {
+    if (s == "inner")
+	return channel_inner;
+    if (s == "outer")
+	return channel_outer;
+    if (s == "humidity")
+	return channel_humidity;
+    throw std::runtime_error ("unknown channel: " + s);
+}
+
+int32_t parse_delta (const std::string& s) {
+    std::istringstream in (s);
+    in.imbue (std::locale::classic ());
+    double d;
+    if (!(in >> d) || in.peek () != EOF || d < 0 || d > 1e6)
+	throw std::runtime_error ("bad delta: " + s);
+    return int32_t (std::llround (d * 1000));
+}
+
+// Sends what it can of s without blocking, and erases that; true once s
+// is empty.
+bool send_some (int fd, std::string& s) {
+    while (!s.empty ()) {
+	ssize_t r = ::send (fd, s.data (), s.size (), MSG_NOSIGNAL);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return false;
+	posix_check (r, "send");
+	s.erase (0, r);
+    }
+    return true;
+}
+
+} // namespace
+
+void sample_server::client::subscribe (const std::vector<std::string>& options) {
+    for (const std::string& o: options) {
+	size_t eq = o.find ('=');
+	std::string key = o.substr (0, eq);
+	std::string value = eq == std::string::npos ? std::string () : o.substr (eq + 1);
+	if (key == "device" && !value.empty ()) {
+	    size_t end;
+	    unsigned long n = std::stoul (value, &end);
+	    if (end != value.size () || n > 0xffff)
+		throw std::runtime_error ("bad device: " + value);
+	    device = n;
+	} else if (key == "channel") {
+	    channel = parse_channel (value);
+	} else if (key == "delta") {
+	    delta = parse_delta (value);
+	} else if (key == "slow" && (value == "close" || value == "drop")) {
+	    drop_slow = value == "drop";
+	} else {
+	    throw std::runtime_error ("bad option: " + o);
+	}
+    }
+    state = streaming;
+}
+
+sample_server::sample_server (event_loop& loop, const server_config& config):
+    loop (loop),
+    config (config),
+    idle_since (std::chrono::steady_clock::now ()),
+    accept_retry (loop, [this] { resume_accepting (); })
+{
+    if (config.listen_fd >= 0) {
+	// an inherited socket may well be blocking
+	listener.reset (config.listen_fd);
+	int flags = posix_check (fcntl (listener.get (), F_GETFL), "fcntl");
+	posix_check (fcntl (listener.get (), F_SETFL, flags | O_NONBLOCK), "fcntl");
+    } else {
+	listener.reset (posix_check (socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), "socket"));
+	sockaddr_un a {};
+	a.sun_family = AF_UNIX;
+	if (config.socket.size () >= sizeof a.sun_path)
+	    throw std::runtime_error ("socket path too long: " + config.socket);
+	std::strcpy (a.sun_path, config.socket.c_str ());
+	::unlink (a.sun_path);
+	posix_check (bind (listener.get (), reinterpret_cast<sockaddr*> (&a), sizeof a), "bind " + config.socket);
+	posix_check (listen (listener.get (), 64), "listen");
+    }
+    loop.add (listener.get (), EPOLLIN, [this] (uint32_t) { accept (); });
+}
+
+sample_server::~sample_server () {
+    for (auto& c: connections)
+	loop.remove (c.first);
+    loop.remove (listener.get ());
+    if (config.listen_fd < 0)
+	::unlink (config.socket.c_str ());
+}
+
+void sample_server::accept () {
+    for (;;) {
+	int fd = accept4 (listener.get (), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (accept_failing)
+		    log_line (log_info).field ("op", "accept") << "accepting again";
+		accept_failing = false;
+		return;
+	    }
+	    // The connection stays queued and the listener readable, so
+	    // carrying on would spin. The log hears once, until the queue
+	    // has been emptied.
+	    if (!accept_failing)
+		log_line ().field ("op", "accept").field ("errno", errno) << "accept: " << std::strerror (errno)
+		    << "; not accepting until a client goes";
+	    accept_failing = true;
+	    pause_accepting ();
+	    return;
+	}
+	std::unique_ptr<client> c (new client);
+	c->fd.reset (fd);
+	client& r = *c;
+	connections[fd] = std::move (c);
+	loop.add (fd, EPOLLIN | EPOLLRDHUP, [this, &r] (uint32_t events) {
+	    if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+		drop (r);
+	    else if (events & EPOLLOUT)
+		writable (r);
+	    else if (events & EPOLLIN)
+		readable (r);
+	});
+    }
+}
+
+void sample_server::pause_accepting () {
+    loop.modify (listener.get (), 0);
+    accepting = false;
+    accept_retry.start (accept_pause);
+}
+
+void sample_server::resume_accepting () {
+    if (accepting)
+	return;
+    accept_retry.cancel ();
+    loop.modify (listener.get (), EPOLLIN);
+    accepting = true;
+}
+
+void sample_server::readable (client& c) {
+    char buf[256];
+    ssize_t n = ::read (c.fd.get (), buf, sizeof buf);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return;
+    if (n <= 0 || c.state != client::reading) {
+	// EOF, an error, or more than the one request
+	drop (c);
+	return;
+    }
+    c.request.append (buf, n);
+    size_t eol = c.request.find ('\n');
+    if (eol != std::string::npos)
+	start (c, c.request.substr (0, eol));
+    else if (c.request.size () > 256)
+	drop (c);
+}
+
+void sample_server::start (client& c, const std::string& request) {
+    std::istringstream ss (request);
+    std::string verb, arg;
+    ss >> verb;
+    try {
+	if (verb == "stream" || verb == "subscribe" || verb == "latest") {
+	    output_format format = config.format;
+	    std::vector<std::string> options;
+	    while (ss >> arg)
+		options.push_back (arg);
+	    if (!options.empty () && options[0].find ('=') == std::string::npos) {
+		format = parse_output_format (options[0]);
+		options.erase (options.begin ());
+	    }
+	    if (verb != "subscribe" && !options.empty ())
+		throw std::runtime_error ("bad option: " + options[0]);
+	    c.out.reset (new sample_output (c.fd.get (), format, config.decimals));
+	    if (verb != "latest") {
+		c.subscribe (options);
+		return;
+	    }
+	    for (const auto& l: latest)
+		c.out->write (l.second);
+	    c.state = client::flushing;
+	    writable (c);
+	} else if (verb == "export") {
+	    if (config.history.empty ())
+		throw std::runtime_error ("no history");
+	    int64_t from = std::numeric_limits<int64_t>::min ();
+	    int64_t to = std::numeric_limits<int64_t>::max ();
+	    ss >> from >> to;
+	    c.exp.reset (new history_export (config.history, from, to));
+	    c.state = client::exporting;
+	    writable (c);
+	} else if (verb == "health") {
+	    if (!config.health)
+		throw std::runtime_error ("no health counters");
+	    std::ostringstream o;
+	    config.health (o);
+	    c.reply = o.str ();
+	    c.state = client::replying;
+	    writable (c);
+	} else {
+	    throw std::runtime_error ("unknown request");
+	}
+    } catch (const std::exception& e) {
+	std::string msg = std::string ("error: ") + e.what () + "\n";
+	::send (c.fd.get (), msg.data (), msg.size (), MSG_NOSIGNAL);
+	drop (c);
+    }
+}
+
+void sample_server::writable (client& c) {
+    bool done;
+    try {
+	switch (c.state) {
+	case client::streaming:
+	    c.out->try_flush ();
+	    watch (c, c.out->pending ());
+	    return;
+	case client::flushing:
+	    done = c.out->try_flush ();
+	    break;
+	case client::exporting:
+	    // a slice at a time, so a fast client cannot hold up the loop;
+	    // the socket stays writable, so the loop comes straight back
+	    done = c.exp->pump (c.fd.get (), export_slice);
+	    break;
+	case client::replying:
+	    done = send_some (c.fd.get (), c.reply);
+	    break;
+	default:
+	    return;
+	}
+    } catch (const std::exception&) {
+	drop (c);
+	return;
+    }
+    if (done)
+	drop (c);
+    else
+	watch (c, true);
+}
+
+void sample_server::watch (client& c, bool out) {
+    if (out == c.want_out)
+	return;
+    c.want_out = out;
+    loop.modify (c.fd.get (), EPOLLIN | EPOLLRDHUP | (out ? uint32_t (EPOLLOUT) : 0));
+}
+
+void sample_server::drop (client& c) {
+    int fd = c.fd.get ();
+    loop.remove (fd);
+    connections.erase (fd);
+    if (connections.empty ())
+	idle_since = std::chrono::steady_clock::now ();
+    resume_accepting ();
+}
+
+std::vector<sample> sample_server::snapshot () const {
+    std::vector<sample> v;
+    for (const auto& l: latest)
+	v.push_back (l.second);
+    return v;
+}
+
+bool sample_server::idle_for (std::chrono::nanoseconds d) const {
+    return connections.empty () && std::chrono::steady_clock::now () - idle_since >= d;
+}
+
+int systemd_listen_fd () {
+    const int listen_fds_start = 3;
+    std::string pid = std::getenv ("LISTEN_PID") ? std::getenv ("LISTEN_PID") : "";
+    std::string fds = std::getenv ("LISTEN_FDS") ? std::getenv ("LISTEN_FDS") : "";
+    ::unsetenv ("LISTEN_PID");
+    ::unsetenv ("LISTEN_FDS");
+    ::unsetenv ("LISTEN_FDNAMES");
+    if (fds.empty ())
+	return -1;
+
+    // Left over from whatever started a parent of ours, as sd_listen_fds ()
+    // also assumes: the descriptors are not ours to take.
+    char* end;
+    long owner = std::strtol (pid.c_str (), &end, 10);
+    if (pid.empty () || *end || owner != getpid ()) {
+	log_line (log_warning) << "ignoring LISTEN_FDS for process " << (pid.empty () ? "(none)" : pid);
+	return -1;
+    }
+    long n = std::strtol (fds.c_str (), &end, 10);
+    if (*end || n < 0)
+	throw std::runtime_error ("socket activation: bad LISTEN_FDS: " + fds);
+    if (n == 0)
+	return -1;
+    if (n > 1)
+	throw std::runtime_error ("socket activation passed more than one socket");
+
+    // what sd_is_socket_unix () checks, since we accept () on it as such
+    int domain, type, listening;
+    socklen_t len = sizeof domain;
+    bool ok = getsockopt (listen_fds_start, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_UNIX;
+    len = sizeof type;
+    ok = ok && getsockopt (listen_fds_start, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+    len = sizeof listening;
+    ok = ok && getsockopt (listen_fds_start, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && listening;
+    if (!ok)
+	throw std::runtime_error ("socket activation: descriptor 3 is not a listening unix stream socket");
+
+    int flags = posix_check (fcntl (listen_fds_start, F_GETFD), "fcntl");
+    posix_check (fcntl (listen_fds_start, F_SETFD, flags | FD_CLOEXEC), "fcntl");
+    return listen_fds_start;
+}
+
+void sample_server::publish (const sample& s) {
+    auto key = std::make_pair (s.device, s.channel);
+    latest[key] = s;
+    for (auto i = connections.begin (); i != connections.end (); ) {
+	client& c = *i++->second;
+	if (c.state != client::streaming || !c.wants (s))
+	    continue;
+	if (!c.out->room ()) {
+	    if (c.drop_slow)
+		++c.dropped;
+	    else
+		drop (c);
+	    continue;
+	}
+	c.out->write (s);
+	if (c.delta)
+	    c.last[key] = s;
+    }
+    if (!flush_deferred) {
+	flush_deferred = true;
+	loop.defer ([this] { flush_subscribers (); });
+    }
+}
+
+void sample_server::flush_subscribers () {
+    flush_deferred = false;
+    for (auto i = connections.begin (); i != connections.end (); ) {
+	client& c = *i++->second;
+	if (c.state != client::streaming || !c.out->pending ())
+	    continue;
+	try {
+	    c.out->try_flush ();
+	    watch (c, c.out->pending ());
+	} catch (const std::exception&) {
+	    drop (c);
+	}
+    }
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,118 @@
+#ifndef TEMPER_SERVER_H
+#define TEMPER_SERVER_H
+
+// Serves readings to clients of a unix stream socket, on an event_loop.
+//
+// A client sends one request line and then only reads:
+//
+//   subscribe [FORMAT] [OPTION...]
+//                              readings from now on, as they arrive
+//   stream [FORMAT]            the same as subscribe with no options
+//   latest [FORMAT]            the latest reading of each device, then EOF
+//   export [FROM [TO]]         the history as a history_export stream, then
+//                              EOF; FROM and TO in nanoseconds since the
+//                              epoch
+//   health                     a line of health counters for each device,
+//                              then EOF; see health.h
+//
+// FORMAT is as for --format and defaults to the server's. A subscription
+// takes these options:
+//
+//   device=N                   only readings from device N
+//   channel=NAME               only the inner, outer or humidity channel
+//   delta=D                    only readings that differ by at least D
+//                              degrees (or percent) from the last one sent
+//                              for their device and channel, or whose
+//                              validity changed
+//   slow=close                 disconnect the client if it falls a whole
+//                              output buffer behind (the default)
+//   slow=drop                  drop readings instead, until it catches up
+//
+// Every socket is non-blocking, and readings published together go out in
+// one write per client, so the acquisition never waits for a subscriber.
+// Out of descriptors, the server stops accepting until a client goes, or
+// for a second, rather than spinning on the listening socket.
+//
+// The listening socket can also be inherited through systemd's socket
+// activation protocol, which needs nothing from libsystemd: see
+// systemd_listen_fd ().
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "event_loop.h"
+#include "output.h"
+#include "posix.h"
+#include "sample.h"
+
+struct server_config {
+    std::string socket;
+    int listen_fd = -1;                 // already listening, if not -1; it
+					//  is taken over and socket is
+					//  neither bound nor removed
+    std::string history;                // for export; empty if none
+    output_format format = format_csv;
+    int decimals = 3;
+    std::function<void (std::ostream&)> health;        // for health; none if empty
+};
+
+class sample_server {
+public:
+    // Replaces any socket file already at the path.
+    sample_server (event_loop& loop, const server_config& config);
+    ~sample_server ();
+    sample_server (const sample_server&) = delete;
+    sample_server& operator= (const sample_server&) = delete;
+
+    // Buffers s for the subscribers that want it; it is written once the
+    // loop has handled the events in hand.
+    void publish (const sample& s);
+
+    // The latest reading of each device and channel.
+    std::vector<sample> snapshot () const;
+
+    size_t clients () const { return connections.size (); }
+
+    // Whether there have been no clients for at least d.
+    bool idle_for (std::chrono::nanoseconds d) const;
+
+private:
+    struct client;
+
+    void accept ();
+    void pause_accepting ();
+    void resume_accepting ();
+    void readable (client& c);
+    void writable (client& c);
+    void start (client& c, const std::string& request);
+    void watch (client& c, bool out);
+    void drop (client& c);
+    void flush_subscribers ();
+
+    event_loop& loop;
+    server_config config;
+    unique_fd listener;
+    std::map<int, std::unique_ptr<client>> connections;
+    std::map<std::pair<uint16_t, uint8_t>, sample> latest;     // by device, channel
+    std::chrono::steady_clock::time_point idle_since;
+    bool flush_deferred = false;
+    loop_timer accept_retry;
+    bool accepting = true;              // the listener is watched
+    bool accept_failing = false;        // since the queue was last empty
+};
+
+// The listening socket passed by systemd socket activation (LISTEN_PID and
+// LISTEN_FDS, as sd_listen_fds () reads them), or -1 if there is none or
+// they were meant for another process. Throws if more than one was
+// passed, or if it is not a listening unix stream socket. The variables
+// are unset so that children do not see them.
+int systemd_listen_fd ();
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
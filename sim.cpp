@@ -0,0 +1,170 @@
+#include "sim.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+int64_t steady_ns () {
+    return std::chrono::duration_cast<std::chrono::nanoseconds> (
+	std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+class sim_device: public report_transport {
+public:
+    sim_device (sim_bus& bus, unsigned n):
+	bus (bus),
+	rng (bus.config ().seed * 0x9e3779b97f4a7c15ULL + n),
+	temp (bus.config ().base)
+    {
+	report_size = temper1_report_size;
+    }
+
+    void send (const msg32& b) override {
+	std::this_thread::sleep_for (latency ());
+	take (b);
+	health.transfer (b.size ());
+    }
+
+    size_t recv (std::span<unsigned char> buf) override {
+	std::this_thread::sleep_for (latency ());
+	size_t n = reply (buf);
+	health.transfer (n);
+	return n;
+    }
+
+    task<> send_co (const msg32& b) override {
+	co_await sim_bus::delay {bus, latency ()};
+	take (b);
+	health.transfer (b.size ());
+    }
+
+    task<size_t> recv_co (std::span<unsigned char> buf) override {
+	co_await sim_bus::delay {bus, latency ()};
+	size_t n = reply (buf);
+	health.transfer (n);
+	co_return n;
+    }
+
+private:
+    std::chrono::nanoseconds latency () {
+	const sim_config& c = bus.config ();
+	if (!c.jitter.count ())
+	    return c.latency;
+	std::uniform_int_distribution<int64_t> d (-c.jitter.count (), c.jitter.count ());
+	return std::max (std::chrono::nanoseconds::zero (), c.latency + std::chrono::nanoseconds (d (rng)));
+    }
+
+    // Checks each report against the frame table of the command under
+    // way, as a replay of what a real device would be sent, and refuses
+    // anything else.
+    void take (const msg32& b) {
+	if (b == cmd_header) {
+	    sent = 1;
+	    return;
+	}
+	try {
+	    if (sent == 1)
+		table = &frames_for (b[0]);
+	} catch (const std::invalid_argument&) {
+	    sent = 0;
+	    throw std::runtime_error ("simulated device: unknown command");
+	}
+	if (!sent || sent == table->size () || b != (*table)[sent]) {
+	    sent = 0;
+	    throw std::runtime_error ("simulated device: unexpected report");
+	}
+	++sent;
+    }
+
+    // Writes a reply into buf, as much of it as fits, the way a device
+    // would fill a short transfer.
+    size_t reply (std::span<unsigned char> buf) {
+	if (sent != frame_table ().size ())
+	    throw std::runtime_error ("simulated device: read without a data request");
+	sent = 0;
+	unsigned char cmd = (*table)[1][0];
+	msg256 r {};
+	switch (cmd) {
+	case cmd_devtype:
+	    // what a TEMPer1 sends, which init () reads as dev_type_temper1
+	    r[0] = 0x57;
+	    r[1] = 0x58;
+	    r[2] = 0x14;
+	    r[6] = 0;
+	    break;
+	case cmd_getdata_inner: {
+	    const sim_config& c = bus.config ();
+	    std::normal_distribution<double> step (0, c.drift), noise (0, c.noise);
+	    temp += step (rng) + (c.base - temp) * 0.01;
+	    // big-endian 1/256 degrees, of which the sensor has 12 bits
+	    int16_t w = int16_t (std::lround ((temp + noise (rng)) * 16)) * 16;
+	    r[0] = uint16_t (w) >> 8;
+	    r[1] = uint16_t (w) & 0xff;
+	    break;
+	}
+	default:
+	    break;
+	}
+	size_t n = std::min (buf.size (), r.size ());
+	std::copy_n (r.begin (), n, buf.begin ());
+	return n;
+    }
+
+    sim_bus& bus;
+    std::mt19937_64 rng;
+    double temp;
+    const frame_table* table = nullptr;
+    size_t sent = 0;                    // reports of *table received
+};
+
+} // namespace
+
+void sim_bus::attach (event_loop& loop) {
+    timer.reset (new loop_timer (loop, [this] { fire (); }));
+}
+
+void sim_bus::detach () {
+    timer.reset ();
+    armed = 0;
+}
+
+std::unique_ptr<report_transport> sim_bus::device (unsigned n) {
+    return std::unique_ptr<report_transport> (new sim_device (*this, n));
+}
+
+void sim_bus::at (std::chrono::nanoseconds d, std::coroutine_handle<> h) {
+    if (!timer)
+	throw std::runtime_error ("simulated device: not attached to an event loop");
+    wakeups.push (wakeup (steady_ns () + d.count (), h));
+    if (!armed || wakeups.top ().first < armed)
+	arm ();
+}
+
+void sim_bus::arm () {
+    if (wakeups.empty ()) {
+	timer->cancel ();
+	armed = 0;
+	return;
+    }
+    armed = wakeups.top ().first;
+    timer->start (std::chrono::nanoseconds (std::max<int64_t> (0, armed - steady_ns ())));
+}
+
+void sim_bus::fire () {
+    armed = 0;
+    int64_t now = steady_ns ();
+    while (!wakeups.empty () && wakeups.top ().first <= now) {
+	std::coroutine_handle<> h = wakeups.top ().second;
+	wakeups.pop ();
+	h.resume ();
+    }
+    if (!armed)
+	arm ();
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,90 @@
+#ifndef TEMPER_SIM_H
+#define TEMPER_SIM_H
+
+// Simulated TEMPer1 devices, for load tests without hardware.
+//
+// Each device speaks the report protocol of protocol.h: it answers
+// cmd_devtype as a TEMPer1 and cmd_getdata_inner with a temperature that
+// wanders around sim_config::base with some noise, in the sensor's 1/16
+// degree steps. Every transfer takes sim_config::latency, give or take
+// jitter, as a USB control transfer to the real thing would. Blocking
+// transfers sleep; asynchronous ones complete from the sim_bus's timer on
+// an event loop, so thousands can be in flight on one thread.
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <memory>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "event_loop.h"
+#include "protocol.h"
+
+struct sim_config {
+    std::chrono::nanoseconds latency {std::chrono::microseconds (1000)};
+    std::chrono::nanoseconds jitter {std::chrono::microseconds (250)};
+    double base = 21;           // degrees Celsius
+    double drift = 0.02;        // random walk per reading, degrees
+    double noise = 0.05;        // per reading, degrees
+    uint64_t seed = 1;
+};
+
+// What simulated devices share: their configuration and, on an event
+// loop, the timer that completes their asynchronous transfers.
+class sim_bus {
+public:
+    explicit sim_bus (const sim_config& cfg): cfg (cfg) {}
+    sim_bus (const sim_bus&) = delete;
+    sim_bus& operator= (const sim_bus&) = delete;
+
+    // Asynchronous transfers complete on loop while an attachment lives.
+    class attachment {
+    public:
+	attachment (sim_bus& bus, event_loop& loop): bus (bus) { bus.attach (loop); }
+	~attachment () { bus.detach (); }
+	attachment (const attachment&) = delete;
+	attachment& operator= (const attachment&) = delete;
+
+    private:
+	sim_bus& bus;
+    };
+
+    // Device n; every device gets its own random sequence.
+    std::unique_ptr<report_transport> device (unsigned n);
+
+    const sim_config& config () const { return cfg; }
+
+    // Resumes the awaiting coroutine from the loop after d.
+    struct delay {
+	sim_bus& bus;
+	std::chrono::nanoseconds d;
+
+	bool await_ready () const noexcept { return false; }
+	void await_suspend (std::coroutine_handle<> h) { bus.at (d, h); }
+	void await_resume () const noexcept {}
+    };
+
+private:
+    typedef std::pair<int64_t, std::coroutine_handle<>> wakeup;        // due, steady ns
+
+    struct later {
+	bool operator() (const wakeup& a, const wakeup& b) const { return a.first > b.first; }
+    };
+
+    void attach (event_loop& loop);
+    void detach ();
+    void at (std::chrono::nanoseconds d, std::coroutine_handle<> h);
+    void fire ();
+    void arm ();
+
+    sim_config cfg;
+    std::unique_ptr<loop_timer> timer;
+    std::priority_queue<wakeup, std::vector<wakeup>, later> wakeups;
+    int64_t armed = 0;                  // due of the timer; 0 if none
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,102 @@
+#include "sink.h"
+
+#include <csignal>
+
+#include <pthread.h>
+
+#include "realtime.h"
+
+sink_thread::sink_thread (consumer c, size_t limit):
+    c (std::move (c)),
+    limit (limit)
+{
+    sigset_t all, old;
+    sigfillset (&all);
+    pthread_sigmask (SIG_BLOCK, &all, &old);
+    thread = std::thread (&sink_thread::run, this);
+    pthread_sigmask (SIG_SETMASK, &old, nullptr);
+}
+
+sink_thread::~sink_thread () {
+    close ();
+}
+
+void sink_thread::push (const sample& s) {
+    {
+	std::lock_guard<std::mutex> l (m);
+	if (failure)
+	    return;
+	if (queue.size () == limit) {
+	    queue.pop_front ();
+	    ++drops;
+	}
+	queue.push_back (s);
+    }
+    cv.notify_one ();
+}
+
+void sink_thread::push (const std::vector<sample>& v) {
+    {
+	std::lock_guard<std::mutex> l (m);
+	if (failure)
+	    return;
+	for (const sample& s: v) {
+	    if (queue.size () == limit) {
+		queue.pop_front ();
+		++drops;
+	    }
+	    queue.push_back (s);
+	}
+    }
+    cv.notify_one ();
+}
+
+void sink_thread::close () {
+    {
+	std::lock_guard<std::mutex> l (m);
+	closing = true;
+    }
+    cv.notify_one ();
+    if (thread.joinable ())
+	thread.join ();
+}
+
+bool sink_thread::failed () const {
+    std::lock_guard<std::mutex> l (m);
+    return bool (failure);
+}
+
+std::exception_ptr sink_thread::error () const {
+    std::lock_guard<std::mutex> l (m);
+    return failure;
+}
+
+size_t sink_thread::dropped () const {
+    std::lock_guard<std::mutex> l (m);
+    return drops;
+}
+
+void sink_thread::run () {
+    realtime_leave ();
+    std::vector<sample> batch;
+    std::unique_lock<std::mutex> l (m);
+    for (;;) {
+	cv.wait (l, [this] { return closing || !queue.empty (); });
+	if (queue.empty ())
+	    return;
+	batch.assign (queue.begin (), queue.end ());
+	queue.clear ();
+	l.unlock ();
+	try {
+	    c (batch);
+	} catch (...) {
+	    l.lock ();
+	    failure = std::current_exception ();
+	    queue.clear ();
+	    return;
+	}
+	l.lock ();
+    }
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,61 @@
+#ifndef TEMPER_SINK_H
+#define TEMPER_SINK_H
+
+// Hands samples from an acquisition loop to a consumer on its own thread.
+//
+// push() never blocks on the consumer: the queue is bounded, and when it
+// is full the oldest samples are dropped and counted, so a slow or stuck
+// consumer costs data rather than sampling cadence. The consumer gets
+// everything queued since its last call in one batch.
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "sample.h"
+
+class sink_thread {
+public:
+    typedef std::function<void (const std::vector<sample>&)> consumer;
+
+    // The thread runs with all signals blocked, leaving them to the
+    // acquisition loop.
+    explicit sink_thread (consumer c, size_t limit = 65536);
+    ~sink_thread ();
+    sink_thread (const sink_thread&) = delete;
+    sink_thread& operator= (const sink_thread&) = delete;
+
+    void push (const sample& s);
+    void push (const std::vector<sample>& v);
+
+    // Delivers what is queued, then stops the thread.
+    void close ();
+
+    // The consumer threw; nothing more is delivered.
+    bool failed () const;
+    std::exception_ptr error () const;
+
+    size_t dropped () const;
+
+private:
+    void run ();
+
+    consumer c;
+    size_t limit;
+    mutable std::mutex m;
+    std::condition_variable cv;
+    std::deque<sample> queue;
+    size_t drops = 0;
+    bool closing = false;
+    std::exception_ptr failure;
+    std::thread thread;
+};
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
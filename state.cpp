@@ -0,0 +1,144 @@
+#include "state.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+const char state_magic[4] = {'T', 'M', 'P', 'T'};
+const bool host_big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+
+size_t align8 (size_t n) {
+    return (n + 7) & ~size_t (7);
+}
+
+} // namespace
+
+state_reader::state_reader (const std::string& path) {
+    unique_fd fd (::open (path.c_str (), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (!fd || fstat (fd.get (), &st) < 0 || size_t (st.st_size) < sizeof (state_header))
+	return;
+    void* p = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get (), 0);
+    if (p == MAP_FAILED)
+	return;
+    base = static_cast<const char*> (p);
+    length = st.st_size;
+
+    const state_header* h = reinterpret_cast<const state_header*> (base);
+    if (std::memcmp (h->magic, state_magic, sizeof h->magic) != 0
+	|| h->version != 2
+	|| h->big_endian != host_big_endian
+	|| sizeof (state_header) + size_t (h->sections) * sizeof (state_section) > length)
+	return;
+    header = h;
+}
+
+state_reader::~state_reader () {
+    if (base)
+	munmap (const_cast<char*> (base), length);
+}
+
+const void* state_reader::find (state_section_kind k, size_t record_size, size_t& n) const {
+    n = 0;
+    if (!header)
+	return nullptr;
+    const state_section* table = reinterpret_cast<const state_section*> (header + 1);
+    for (const state_section* s = table; s != table + header->sections; ++s) {
+	if (s->kind != k)
+	    continue;
+	if (s->record_size != record_size || s->offset % 8 || s->offset > length
+	    || s->count > (length - s->offset) / record_size)
+	    return nullptr;
+	n = s->count;
+	return base + s->offset;
+    }
+    return nullptr;
+}
+
+void state_writer::add (state_section_kind k, const void* records, size_t record_size, size_t count) {
+    const char* p = static_cast<const char*> (records);
+    sections.push_back (pending {k, std::vector<char> (p, p + record_size * count), record_size, count});
+}
+
+void state_writer::commit (const std::string& path) const {
+    state_header h {};
+    std::memcpy (h.magic, state_magic, sizeof h.magic);
+    h.version = 2;
+    h.big_endian = host_big_endian;
+    h.sections = sections.size ();
+    h.written = now_ns ();
+
+    std::vector<state_section> table;
+    size_t offset = align8 (sizeof h + sections.size () * sizeof (state_section));
+    for (const pending& s: sections) {
+	table.push_back (state_section {s.kind, uint32_t (s.record_size), offset, s.count});
+	offset = align8 (offset + s.bytes.size ());
+    }
+
+    std::string tmp = path + ".tmp";
+    {
+	static const char zeros[8] = {};
+	unique_fd fd (posix_check (::open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666), tmp));
+	write_all (fd.get (), &h, sizeof h, tmp);
+	write_all (fd.get (), table.data (), table.size () * sizeof (state_section), tmp);
+	size_t at = sizeof h + table.size () * sizeof (state_section);
+	for (size_t i = 0; i < sections.size (); ++i) {
+	    write_all (fd.get (), zeros, table[i].offset - at, tmp);
+	    write_all (fd.get (), sections[i].bytes.data (), sections[i].bytes.size (), tmp);
+	    at = table[i].offset + sections[i].bytes.size ();
+	}
+	posix_check (::fsync (fd.get ()), tmp);
+    }
+    posix_check (::rename (tmp.c_str (), path.c_str ()), tmp);
+}
+
+bool load_state (const std::string& path, daemon_state& s) {
+    state_reader r (path);
+    if (!r.valid ())
+	return false;
+
+    daemon_state next;
+    auto devices = r.section<state_device> (state_devices);
+    for (const state_device* d = devices.first; d != devices.first + devices.second; ++d) {
+	device_identity id {std::string (d->path, strnlen (d->path, sizeof d->path)),
+	    d->vendor, d->product, d->release, d->address};
+	device_profile p {id, d->dev_type, {}, d->footer};
+	std::memcpy (p.cal, d->cal, sizeof p.cal);
+	next.devices.push_back (p);
+    }
+    auto latest = r.section<sample> (state_latest);
+    next.latest.assign (latest.first, latest.first + latest.second);
+    s = std::move (next);
+    return true;
+}
+
+void save_state (const std::string& path, const daemon_state& s) {
+    std::vector<state_device> devices;
+    for (const device_profile& p: s.devices) {
+	const device_identity& id = p.identity;
+	if (id.path.size () > sizeof (state_device::path))
+	    continue;           // the next run probes it
+	state_device d {};
+	std::memcpy (d.path, id.path.data (), id.path.size ());
+	d.dev_type = p.dev_type;
+	std::memcpy (d.cal, p.cal, sizeof d.cal);
+	d.footer = p.footer;
+	d.address = id.address;
+	d.vendor = id.vendor;
+	d.product = id.product;
+	d.release = id.release;
+	devices.push_back (d);
+    }
+
+    state_writer w;
+    w.add (state_devices, devices);
+    w.add (state_latest, s.latest);
+    w.commit (path);
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,144 @@
+#ifndef TEMPER_STATE_H
+#define TEMPER_STATE_H
+
+// The daemon's state file.
+//
+// serve writes what it knows on exit and maps it back on start, so that a
+// restart, or the next socket-activated run, skips the device type probe
+// and answers with the last readings straight away. The file is a
+// state_header, a table of state_sections, then each section's records at
+// 8-byte aligned offsets. Sections of a kind or record size this build
+// does not know are skipped, so later builds can add state without
+// invalidating older files. It is only a hint: a missing, damaged or
+// foreign file is ignored.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "posix.h"
+#include "sample.h"
+
+struct state_header {
+    char magic[4];              // "TMPT"
+    uint8_t version;
+    uint8_t big_endian;
+    uint16_t sections;
+    int64_t written;            // nanoseconds since the epoch
+    char pad[16];
+};
+static_assert (sizeof (state_header) == 32, "state_header is stored on disk as-is");
+
+enum state_section_kind: uint32_t {
+    state_devices = 1,          // state_device records
+    state_latest  = 2           // sample records
+};
+
+struct state_section {
+    uint32_t kind;              // state_section_kind
+    uint32_t record_size;
+    uint64_t offset;            // from the start of the file
+    uint64_t count;
+};
+static_assert (sizeof (state_section) == 24, "state_section is stored on disk as-is");
+
+// A device's reply to cmd_devtype, and which device it was.
+struct state_device {
+    char path[30];              // usb_device_found::path, NUL-padded
+    uint16_t dev_type;
+    uint8_t cal[2][2];          // factory calibration bytes
+    uint8_t footer;
+    uint8_t address;            // device_identity
+    uint16_t vendor;
+    uint16_t product;
+    uint16_t release;
+    uint8_t pad[4];
+};
+static_assert (sizeof (state_device) == 48, "state_device is stored on disk as-is");
+
+// A read-only mapping of a state file.
+class state_reader {
+public:
+    explicit state_reader (const std::string& path);
+    ~state_reader ();
+    state_reader (const state_reader&) = delete;
+    state_reader& operator= (const state_reader&) = delete;
+
+    // False if the file is missing or not a state file of this version
+    // and byte order.
+    bool valid () const { return header != nullptr; }
+
+    // The records of the first section of kind k, if their size is
+    // sizeof (T); otherwise none.
+    template <typename T>
+    std::pair<const T*, size_t> section (state_section_kind k) const {
+	size_t n;
+	const void* p = find (k, sizeof (T), n);
+	return std::make_pair (static_cast<const T*> (p), n);
+    }
+
+private:
+    const void* find (state_section_kind k, size_t record_size, size_t& n) const;
+
+    const char* base = nullptr;
+    size_t length = 0;
+    const state_header* header = nullptr;
+};
+
+// Collects sections, then replaces the file atomically.
+class state_writer {
+public:
+    template <typename T>
+    void add (state_section_kind k, const std::vector<T>& v) {
+	add (k, v.data (), sizeof (T), v.size ());
+    }
+    void add (state_section_kind k, const void* records, size_t record_size, size_t count);
+
+    void commit (const std::string& path) const;
+
+private:
+    struct pending {
+	state_section_kind kind;
+	std::vector<char> bytes;
+	size_t record_size;
+	size_t count;
+    };
+    std::vector<pending> sections;
+};
+
+// Where a device is attached and what its USB device descriptor says it
+// is. The bus gives a device a new address whenever it is plugged in, so
+// an identity from an earlier run only matches the same device, still
+// attached; TEMPer models all share one vendor and product ID.
+struct device_identity {
+    std::string path;
+    uint16_t vendor = 0;
+    uint16_t product = 0;
+    uint16_t release = 0;       // bcdDevice
+    uint8_t address = 0;
+
+    bool operator== (const device_identity&) const = default;
+};
+
+struct device_profile {
+    device_identity identity;
+    uint16_t dev_type;
+    uint8_t cal[2][2];
+    uint8_t footer;
+};
+
+struct daemon_state {
+    std::vector<device_profile> devices;
+    std::vector<sample> latest;
+};
+
+// Returns false, leaving s alone, if there is no usable state at path.
+bool load_state (const std::string& path, daemon_state& s);
+
+void save_state (const std::string& path, const daemon_state& s);
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
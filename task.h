@@ -0,0 +1,153 @@
+#ifndef TEMPER_TASK_H
+#define TEMPER_TASK_H
+
+// A lazy coroutine task for single-threaded event loops.
+//
+// A task<T> does nothing until it is co_awaited, or handed to spawn ();
+// then it runs until its first real suspension, such as a transfer
+// awaiting completion, and is resumed from whatever completes that. When
+// it finishes, its awaiter is resumed in turn without growing the stack.
+// Nothing here is thread-safe: a task and everything it awaits belong to
+// one thread, typically the one running the event_loop.
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+template <typename T = void>
+class task;
+
+namespace task_detail {
+
+struct promise_base {
+    std::coroutine_handle<> continuation = std::noop_coroutine ();
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend () noexcept { return {}; }
+
+    struct final_awaiter {
+	bool await_ready () noexcept { return false; }
+	template <typename P>
+	std::coroutine_handle<> await_suspend (std::coroutine_handle<P> h) noexcept {
+	    return h.promise ().continuation;
+	}
+	void await_resume () noexcept {}
+    };
+    final_awaiter final_suspend () noexcept { return {}; }
+
+    void unhandled_exception () noexcept { error = std::current_exception (); }
+
+    void rethrow () const {
+	if (error)
+	    std::rethrow_exception (error);
+    }
+};
+
+template <typename T>
+struct promise: promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object () noexcept;
+    void return_value (T v) { value.emplace (std::move (v)); }
+
+    T result () {
+	rethrow ();
+	return std::move (*value);
+    }
+};
+
+template <>
+struct promise<void>: promise_base {
+    task<void> get_return_object () noexcept;
+    void return_void () noexcept {}
+
+    void result () { rethrow (); }
+};
+
+} // namespace task_detail
+
+template <typename T>
+class task {
+public:
+    typedef task_detail::promise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle;
+
+    explicit task (handle h): h (h) {}
+    task (task&& o) noexcept: h (std::exchange (o.h, nullptr)) {}
+    task& operator= (task&& o) noexcept {
+	if (h)
+	    h.destroy ();
+	h = std::exchange (o.h, nullptr);
+	return *this;
+    }
+    ~task () {
+	if (h)
+	    h.destroy ();
+    }
+
+    bool await_ready () const noexcept { return false; }
+    std::coroutine_handle<> await_suspend (std::coroutine_handle<> awaiting) noexcept {
+	h.promise ().continuation = awaiting;
+	return h;
+    }
+    T await_resume () { return h.promise ().result (); }
+
+private:
+    handle h;
+};
+
+namespace task_detail {
+
+template <typename T>
+task<T> promise<T>::get_return_object () noexcept {
+    return task<T> (std::coroutine_handle<promise<T>>::from_promise (*this));
+}
+
+inline task<void> promise<void>::get_return_object () noexcept {
+    return task<void> (std::coroutine_handle<promise<void>>::from_promise (*this));
+}
+
+// The frame spawn () leaves running; it destroys itself when done.
+struct detached {
+    struct promise_type {
+	detached get_return_object () noexcept { return {}; }
+	std::suspend_never initial_suspend () noexcept { return {}; }
+	std::suspend_never final_suspend () noexcept { return {}; }
+	void return_void () noexcept {}
+	void unhandled_exception () noexcept { std::terminate (); }
+    };
+};
+
+} // namespace task_detail
+
+// Starts t and returns at its first suspension. done is called with the
+// result, or with the exception t ended with and a default T; it must not
+// throw.
+template <typename T>
+task_detail::detached spawn (task<T> t, std::function<void (std::exception_ptr, std::type_identity_t<T>)> done) {
+    std::exception_ptr e;
+    std::optional<T> v;
+    try {
+	v.emplace (co_await t);
+    } catch (...) {
+	e = std::current_exception ();
+    }
+    done (e, v ? std::move (*v) : T {});
+}
+
+inline task_detail::detached spawn (task<void> t, std::function<void (std::exception_ptr)> done) {
+    std::exception_ptr e;
+    try {
+	co_await t;
+    } catch (...) {
+	e = std::current_exception ();
+    }
+    done (e);
+}
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
@@ -5,15 +5,58 @@
 
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <csignal>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <libusb.h>
 
+#include "align.h"
+#include "decode.h"
+#include "event_loop.h"
+#include "executor.h"
+#include "expr.h"
+#include "export.h"
+#include "health.h"
+#include "history.h"
+#include "log.h"
+#include "output.h"
+#include "protocol.h"
+#include "realtime.h"
+#include "ring.h"
+#include "sample.h"
+#include "server.h"
+#include "sim.h"
+#include "sink.h"
+#include "state.h"
+#include "task.h"
+
 struct usb_error: std::exception {
     libusb_error e;
 
@@ -54,7 +97,8 @@ struct usb_attach_interface {
 	if (was_attached)
 	    usb_error::check (libusb_attach_kernel_driver (h.get (), interface));
     } catch (const usb_error& e) {
-	std::cerr << __FILE__ << ":" << __LINE__ << " (" << __func__ << "): " << e.what () << '\n';
+	log_line ().field ("op", "attach_kernel_driver").field ("interface", interface)
+	    << __FILE__ << ":" << __LINE__ << " (" << __func__ << "): " << e;
     }
 };
 
@@ -72,23 +116,61 @@ struct usb_claim_interface {
     ~usb_claim_interface () try {
 	usb_error::check (libusb_release_interface (h.get (), interface));
     } catch (const usb_error& e) {
-	std::cerr << __FILE__ << ":" << __LINE__ << " (" << __func__ << "): " << e.what ();
+	log_line ().field ("op", "release_interface").field ("interface", interface)
+	    << __FILE__ << ":" << __LINE__ << " (" << __func__ << "): " << e;
     }
 };
 
-typedef std::array<unsigned char, 32> msg32;
-typedef std::array<unsigned char, 256> msg256;
-
 enum hid_req {
     get_report = 0x01,
     set_report = 0x09
 };
 
-void usb_send (std::shared_ptr<libusb_device_handle> dh, msg32 data) {
+health_error usb_error_class (libusb_error e) {
+    switch (e) {
+    case LIBUSB_ERROR_TIMEOUT:          return error_timeout;
+    case LIBUSB_ERROR_PIPE:             return error_pipe;
+    case LIBUSB_ERROR_NO_DEVICE:        return error_no_device;
+    case LIBUSB_ERROR_IO:               return error_io;
+    case LIBUSB_ERROR_OVERFLOW:         return error_overflow;
+    default:                            return error_other;
+    }
+}
+
+// Counts the exception in hand against h, by class.
+void usb_count_failure (device_health& h) {
+    try {
+	throw;
+    } catch (const usb_error& e) {
+	h.error (usb_error_class (e.e));
+    } catch (const short_report&) {
+	h.short_read ();
+    } catch (...) {
+	h.error (error_other);
+    }
+}
+
+// Whether the exception e is worth another try: the device was slow or
+// garbled a reply, rather than gone.
+bool usb_transient (std::exception_ptr e) {
+    try {
+	std::rethrow_exception (e);
+    } catch (const usb_error& u) {
+	return u.e == LIBUSB_ERROR_TIMEOUT || u.e == LIBUSB_ERROR_PIPE;
+    } catch (const short_report&) {
+	return true;
+    } catch (...) {
+	return false;
+    }
+}
+
+// data is typically a frame_table's, sent from where it is; libusb only
+// reads an OUT transfer's buffer.
+void usb_send (const std::shared_ptr<libusb_device_handle>& dh, const msg32& data) {
     int r = libusb_control_transfer (dh.get (),
 	LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, set_report,
 	0x0200, 0x0001,
-	&data[0], data.size (),
+	const_cast<unsigned char*> (data.data ()), data.size (),
 	1000);
     usb_error::check (r);
     if (r != int (data.size ())) {
@@ -98,142 +180,437 @@ void usb_send (std::shared_ptr<libusb_device_handle> dh, msg32 data) {
     }
 }
 
-msg256 usb_recv (std::shared_ptr<libusb_device_handle> dh) {
-    msg256 result;
+// Receives a report into buf, the caller's, and gives its length, which
+// may be less than buf's: the views check what they need is there.
+size_t usb_recv (const std::shared_ptr<libusb_device_handle>& dh, std::span<unsigned char> buf) {
     int r = libusb_control_transfer (dh.get (),
 	LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, get_report,
 	0x0300, 0x0001,
-	&result[0], result.size (),
+	buf.data (), uint16_t (buf.size ()),
 	1000);
-    usb_error::check (r);
-    if (r < int (result.size ())) {
+    return usb_error::check (r);
+}
+
+// hid_report_size () of the interface's HID report descriptor, or 0 if it
+// cannot be read.
+size_t usb_hid_report_size (const std::shared_ptr<libusb_device_handle>& dh, uint16_t interface) {
+    std::array<unsigned char, 512> d;
+    int r = libusb_control_transfer (dh.get (),
+	LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR,
+	LIBUSB_DT_REPORT << 8, interface,
+	d.data (), d.size (),
+	1000);
+    return r > 0 ? hid_report_size (std::span<const unsigned char> (d.data (), r)) : 0;
+}
+
+// An asynchronous control transfer, for use on an event loop. done is
+// called from libusb's event handling with the number of bytes transferred
+// or a libusb_error, and the data stage; it must not throw. Failure to
+// submit is thrown straight away.
+typedef std::function<void (int r, const unsigned char* data)> usb_control_done;
+
+int usb_transfer_result (const libusb_transfer* t) {
+    switch (t->status) {
+    case LIBUSB_TRANSFER_COMPLETED:     return t->actual_length;
+    case LIBUSB_TRANSFER_TIMED_OUT:     return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:         return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:     return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:      return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED:     return LIBUSB_ERROR_INTERRUPTED;
+    default:                            return LIBUSB_ERROR_IO;
+    }
+}
+
+void usb_control_async (libusb_device_handle* h, uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+	const unsigned char* out, uint16_t length, usb_control_done done) {
+    struct pending {
+	std::vector<unsigned char> buf;
+	usb_control_done done;
+
+	static void callback (libusb_transfer* t) {
+	    std::unique_ptr<pending> p (static_cast<pending*> (t->user_data));
+	    int r = usb_transfer_result (t);
+	    libusb_free_transfer (t);
+	    p->done (r, p->buf.data () + LIBUSB_CONTROL_SETUP_SIZE);
+	}
+    };
+
+    std::unique_ptr<pending> p (new pending);
+    p->buf.resize (LIBUSB_CONTROL_SETUP_SIZE + length);
+    p->done = std::move (done);
+    libusb_fill_control_setup (p->buf.data (), type, request, value, index, length);
+    if (out)
+	std::copy (out, out + length, p->buf.begin () + LIBUSB_CONTROL_SETUP_SIZE);
+
+    libusb_transfer* t = libusb_alloc_transfer (0);
+    if (!t)
+	throw usb_error (LIBUSB_ERROR_NO_MEM);
+    libusb_fill_control_transfer (t, h, p->buf.data (), pending::callback, p.get (), 1000);
+    int r = libusb_submit_transfer (t);
+    if (r < 0) {
+	libusb_free_transfer (t);
+	usb_error::check (r);
+    }
+    p.release ();
+}
+
+// Awaits an asynchronous control transfer, giving the number of bytes
+// transferred. For IN transfers the data stage is copied to in. The
+// awaiting coroutine is resumed from libusb's event handling.
+struct usb_control_awaiter {
+    libusb_device_handle* h;
+    uint8_t type;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    const unsigned char* out;
+    unsigned char* in;
+    uint16_t length;
+    int r = 0;
+
+    bool await_ready () const noexcept { return false; }
+
+    void await_suspend (std::coroutine_handle<> c) {
+	usb_control_async (h, type, request, value, index, out, length, [this, c] (int n, const unsigned char* data) {
+	    r = n;
+	    if (in && n > 0)
+		std::copy (data, data + n, in);
+	    c.resume ();
+	});
+    }
+
+    int await_resume () const { return usb_error::check (r); }
+};
+
+// usb_send () and usb_recv () as coroutines, for an event loop driving
+// usb_event_source. data must last until the transfer is submitted, as a
+// frame_table's does.
+task<> usb_send_co (std::shared_ptr<libusb_device_handle> dh, const msg32& data) {
+    int r = co_await usb_control_awaiter {dh.get (),
+	LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, set_report,
+	0x0200, 0x0001,
+	data.data (), nullptr, uint16_t (data.size ())};
+    if (r != int (data.size ())) {
 	std::ostringstream ss;
-	ss << "wrong number of bytes read: " << r;
+	ss << "wrong number of bytes written: " << r;
 	throw std::runtime_error (ss.str ());
     }
-    return result;
 }
 
+task<size_t> usb_recv_co (std::shared_ptr<libusb_device_handle> dh, std::span<unsigned char> buf) {
+    int r = co_await usb_control_awaiter {dh.get (),
+	LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, get_report,
+	0x0300, 0x0001,
+	nullptr, buf.data (), uint16_t (buf.size ())};
+    co_return r;
+}
+
+// Lets an event_loop drive libusb: libusb's descriptors are watched in the
+// loop, and so is its next timeout where the platform does not already
+// signal timeouts through a descriptor.
+class usb_event_source {
+public:
+    usb_event_source (libusb_context* usb, event_loop& loop):
+	usb (usb),
+	loop (loop),
+	timeout (loop, [this] { handle (); })
+    {
+	std::unique_ptr<const libusb_pollfd*, decltype(&libusb_free_pollfds)> fds (
+	    libusb_get_pollfds (usb), libusb_free_pollfds);
+	if (!fds)
+	    throw std::runtime_error ("libusb cannot be driven from an event loop here");
+	for (const libusb_pollfd** p = fds.get (); *p; ++p)
+	    added ((*p)->fd, (*p)->events, this);
+	libusb_set_pollfd_notifiers (usb, added, removed, this);
+    }
+
+    ~usb_event_source () {
+	libusb_set_pollfd_notifiers (usb, nullptr, nullptr, nullptr);
+	for (int fd: watched)
+	    loop.remove (fd);
+    }
+
+    usb_event_source (const usb_event_source&) = delete;
+    usb_event_source& operator= (const usb_event_source&) = delete;
+
+    // To be called after submitting transfers, so that their timeouts are
+    // watched.
+    void update () {
+	if (libusb_pollfds_handle_timeouts (usb))
+	    return;
+	timeval tv;
+	if (usb_error::check (libusb_get_next_timeout (usb, &tv)))
+	    timeout.start (std::chrono::seconds (tv.tv_sec) + std::chrono::microseconds (tv.tv_usec));
+	else
+	    timeout.cancel ();
+    }
+
+private:
+    static void added (int fd, short events, void* p) {
+	usb_event_source* self = static_cast<usb_event_source*> (p);
+	uint32_t ev = (events & POLLIN ? uint32_t (EPOLLIN) : 0) | (events & POLLOUT ? uint32_t (EPOLLOUT) : 0);
+	self->loop.add (fd, ev, [self] (uint32_t) { self->handle (); });
+	self->watched.push_back (fd);
+    }
+
+    static void removed (int fd, void* p) {
+	usb_event_source* self = static_cast<usb_event_source*> (p);
+	self->loop.remove (fd);
+	self->watched.erase (std::remove (self->watched.begin (), self->watched.end (), fd), self->watched.end ());
+    }
+
+    void handle () {
+	timeval zero {};
+	usb_error::check (libusb_handle_events_timeout_completed (usb, &zero, nullptr));
+	update ();
+    }
+
+    libusb_context* usb;
+    event_loop& loop;
+    loop_timer timeout;
+    std::vector<int> watched;
+};
+
 auto libusb_device_list_deleter = [](libusb_device** d) { libusb_free_device_list(d, 1); };
 
 std::pair<std::unique_ptr<libusb_device*, decltype(libusb_device_list_deleter)>, ssize_t> usb_device_list (libusb_context* usb) {
     libusb_device** p;
-    ssize_t n = libusb_get_device_list (usb, &p);
+    ssize_t n = usb_error::check (libusb_get_device_list (usb, &p));
     return std::make_pair (
         std::unique_ptr<libusb_device*, decltype(libusb_device_list_deleter)> (p, libusb_device_list_deleter),
         n
     );
 }
 
-std::shared_ptr<libusb_device_handle> usb_device_get (libusb_context* usb, uint16_t vendor, uint16_t product) {
-    auto list = usb_device_list (usb);
-    for (libusb_device** dev = list.first.get (); dev != list.first.get () + list.second; ++dev) {
+struct usb_device_found {
+    libusb_device* dev;
+    std::vector<uint8_t> ports;         // bus, then the port path
+    std::string path;                   // "bus-port.port..."
+    device_identity identity;
+};
+
+// Matching devices in bus/port order, which stays the same from run to
+// run. The pointers live as long as list.
+std::vector<usb_device_found> usb_devices_find (libusb_device** list, ssize_t n, uint16_t vendor, uint16_t product) {
+    std::vector<usb_device_found> found;
+    for (libusb_device** dev = list; dev != list + n; ++dev) {
 	libusb_device_descriptor d;
 	usb_error::check (libusb_get_device_descriptor (*dev, &d));
-	if (d.idVendor == vendor && d.idProduct == product) {
-	    libusb_device_handle* p;
-	    usb_error::check (libusb_open (*dev, &p));
-	    return std::shared_ptr<libusb_device_handle> (p, libusb_close);
-	}
-    }
+	if (d.idVendor != vendor || d.idProduct != product)
+	    continue;
 
-    throw std::runtime_error ("could not find device");
+	usb_device_found f;
+	f.dev = *dev;
+	uint8_t ports[8];
+	int np = usb_error::check (libusb_get_port_numbers (*dev, ports, sizeof ports));
+	f.ports.push_back (libusb_get_bus_number (*dev));
+	f.ports.insert (f.ports.end (), ports, ports + np);
+	std::ostringstream ss;
+	ss << int (f.ports[0]);
+	for (int i = 0; i < np; ++i)
+	    ss << (i ? '.' : '-') << int (ports[i]);
+	f.path = ss.str ();
+	f.identity = {f.path, d.idVendor, d.idProduct, d.bcdDevice, libusb_get_device_address (*dev)};
+	found.push_back (f);
+    }
+    std::sort (found.begin (), found.end (), [](const usb_device_found& a, const usb_device_found& b) {
+	return a.ports < b.ports;
+    });
+    return found;
 }
 
-void send_cmd (std::shared_ptr<libusb_device_handle> dh, unsigned char cmd) {
+std::shared_ptr<libusb_device_handle> usb_device_open (libusb_device* dev) {
+    libusb_device_handle* p;
+    usb_error::check (libusb_open (dev, &p));
+    return std::shared_ptr<libusb_device_handle> (p, libusb_close);
+}
 
-    // hey, here comes a command!
-    {
-	msg32 b = {{0x0a, 0x0b, 0x0c, 0x0d, 0x00, 0x00, 0x02, 0x00}};
-	usb_send (dh, b);
+struct usb_set_configuration {
+    usb_set_configuration (std::shared_ptr<libusb_device_handle> h, int configuration) {
+	usb_error::check (libusb_set_configuration (h.get (), configuration));
     }
+};
 
-    // issue the command
-    {
-	msg32 b = {{0}};
-	b[0] = cmd;
-	usb_send (dh, b);
-    }
+// A TEMPer's reports over USB control transfers, on a handle whose
+// interfaces are already claimed.
+class usb_link: public report_transport {
+public:
+    explicit usb_link (std::shared_ptr<libusb_device_handle> h): dh (h) {}
 
-    // i2c bus padding
-    {
-	msg32 b = {{0}};
-	for (int i = 0; i < 7; ++i)
+    void send (const msg32& b) override {
+	try {
 	    usb_send (dh, b);
+	} catch (...) {
+	    usb_count_failure (health);
+	    throw;
+	}
+	health.transfer (b.size ());
     }
-}
-
-msg256 read_data (std::shared_ptr<libusb_device_handle> dh, unsigned char cmd) {
-    send_cmd (dh, cmd);
 
-    // hey, give me the data!
-    msg32 b = {{10, 11, 12, 13, 0, 0, 1, 0}};
-    usb_send (dh, b);
+    size_t recv (std::span<unsigned char> buf) override {
+	size_t n;
+	try {
+	    n = usb_recv (dh, buf);
+	} catch (...) {
+	    usb_count_failure (health);
+	    throw;
+	}
+	health.transfer (n);
+	return n;
+    }
 
-    return usb_recv (dh);
-}
+    task<> send_co (const msg32& b) override {
+	try {
+	    co_await usb_send_co (dh, b);
+	} catch (...) {
+	    usb_count_failure (health);
+	    throw;
+	}
+	health.transfer (b.size ());
+    }
 
-enum cmds {
-    cmd_getdata_ntc   = 0x41,
-    cmd_reset0	      = 0x43,
-    cmd_reset1	      = 0x44,
-    cmd_getdata       = 0x48,
-    cmd_devtype       = 0x52,
-    cmd_getdata_outer = 0x53,
-    cmd_getdata_inner = 0x54
-};
+    task<size_t> recv_co (std::span<unsigned char> buf) override {
+	size_t n;
+	try {
+	    n = co_await usb_recv_co (dh, buf);
+	} catch (...) {
+	    usb_count_failure (health);
+	    throw;
+	}
+	health.transfer (n);
+	co_return n;
+    }
 
-enum dev_types {
-    dev_type_temperhum	= 0x5a53,
-    dev_type_temperhum2 = 0x5a57,
-    dev_type_temper1	= 0x5857,
-    dev_type_temper2	= 0x5957,
-    dev_type_temperntc	= 0x5b57
+protected:
+    std::shared_ptr<libusb_device_handle> dh;
 };
 
-int main () try {
-    auto usb = usb_open();
+// A usb_link that takes the device over from the kernel, and claims it,
+// for as long as it lives.
+class usb_transport: public usb_link {
+public:
+    explicit usb_transport (std::shared_ptr<libusb_device_handle> h):
+	usb_link (h),
+	a1 (dh, 0),
+	a2 (dh, 1),
+	config (dh, 1),
+	i1 (dh, 0),
+	i2 (dh, 1)
+    {
+	if (size_t n = usb_hid_report_size (dh, 1))
+	    report_size = std::min (n, report_size);
+    }
 
-    std::shared_ptr<libusb_device_handle> dh = usb_device_get (usb.get(), 0x1130, 0x660c);
+private:
+    usb_attach_interface a1;
+    usb_attach_interface a2;
+    usb_set_configuration config;
+    usb_claim_interface i1;
+    usb_claim_interface i2;
+};
 
-    usb_attach_interface a1 (dh, 0);
-    usb_attach_interface a2 (dh, 1);
+int64_t monotonic_ns () {
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    usb_error::check (libusb_set_configuration (dh.get (), 1));
+// A TEMPer, real or simulated, initialised and ready to read. Transfers
+// must go through io, which keeps each command and its reply together.
+struct temper_device {
+    uint16_t id;                        // sample::device
+    std::string path;
+    strand io;
+    std::unique_ptr<report_transport> link;
+    msg256 rx;                          // replies, read in place; one
+					//  transfer is under way at a time
+    device_profile profile;             // the devtype reply
 
-    usb_claim_interface i1 (dh, 0);
-    usb_claim_interface i2 (dh, 1);
+    // known, if not null, is the profile from an earlier run of the device
+    // with this identity, which saves probing for it.
+    temper_device (worker_pool& pool, std::unique_ptr<report_transport> link, uint16_t id, const device_identity& where,
+	    const device_profile* known = nullptr):
+	id (id),
+	path (where.path),
+	io (pool),
+	link (std::move (link)),
+	profile (init (where, known))
+    {}
 
-    // init
-    {
-	struct dev_info {
-	    uint16_t dev_type;
-	    uint8_t cal[2][2];
-	    // OpenBSD repeatedly issues the devtype command until this != 0x53
-	    // Maybe this is necessary if the device has just been plugged in
-	    // and has not settled yet?
-	    uint8_t footer;
-	} dinfo;
-	msg256 dinfo_raw = read_data (dh, cmd_devtype);
-	std::copy (std::begin(dinfo_raw), std::end(dinfo_raw), reinterpret_cast<unsigned char*> (&dinfo));
+    device_profile init (const device_identity& where, const device_profile* known) {
+	device_profile p = known ? *known : probe ();
 
 	//int val;
-	switch (dinfo.dev_type) {
+	switch (p.dev_type) {
 	case dev_type_temper1:
-	    send_cmd (dh, cmd_reset0);
-	    /*val = (dinfo.cal[0][0] - 0x14) * 100;
-	    val += dinfo.cal[0][1] * 10;
+	    link->report_size = std::min (link->report_size, temper1_report_size);
+	    send_cmd (*link, cmd_reset0);
+	    link->health.reset ();
+	    /*val = (p.cal[0][0] - 0x14) * 100;
+	    val += p.cal[0][1] * 10;
 	    std::cerr << "calibration: " << val << std::endl;*/
 	    break;
 	default:
 	    throw std::runtime_error ("unknwon device type");
 	}
+	p.identity = where;
+	return p;
     }
 
-    // read
-    {
-	msg256 d = read_data (dh, cmd_getdata_inner);
+    device_profile probe () {
+	devtype_view d (read_data (*link, cmd_devtype, rx));
+	device_profile p {{}, d.dev_type (), {}, d.footer ()};
+	for (unsigned sensor = 0; sensor < 2; ++sensor)
+	    for (unsigned i = 0; i < 2; ++i)
+		p.cal[sensor][i] = d.cal (sensor, i);
+	return p;
+    }
+
+    // A reading is tried again this many times after a transient failure.
+    static const unsigned read_retries = 1;
+
+    // Whether a reading that failed with e is worth another try. Replies
+    // too short to read, which the transport cannot tell from good ones,
+    // are counted here.
+    bool transient_failure (std::exception_ptr e) {
+	try {
+	    std::rethrow_exception (e);
+	} catch (const short_report&) {
+	    link->health.short_read ();
+	} catch (...) {
+	}
+	return usb_transient (e);
+    }
 
+    sample read (const calibration& cal) {
+	for (unsigned attempt = 0; ; ++attempt) {
+	    try {
+		return to_sample (read_data (*link, cmd_getdata_inner, rx), cal);
+	    } catch (...) {
+		if (!transient_failure (std::current_exception ()) || attempt == read_retries)
+		    throw;
+	    }
+	    link->health.retry ();
+	}
+    }
+
+    // read () on an event loop that drives the transport.
+    task<sample> read_co (calibration cal) {
+	for (unsigned attempt = 0; ; ++attempt) {
+	    std::exception_ptr e;
+	    try {
+		report_view d = co_await read_data_co (*link, cmd_getdata_inner, rx);
+		co_return to_sample (d, cal);
+	    } catch (...) {
+		e = std::current_exception ();
+	    }
+	    if (!transient_failure (e) || attempt == read_retries)
+		std::rethrow_exception (e);
+	    link->health.retry ();
+	}
+    }
+
+    sample to_sample (report_view d, const calibration& cal) const {
 	// raw values
 	/*
 	std::ostringstream h;
@@ -245,13 +622,1400 @@ int main () try {
 	// from OpenBSD
 	//std::cout << d[0] * 100 + (d[1] >> 4) * 25 / 4 << std::endl;
 
-	// easy way
-	std::cout << float (d[0]) + float (d[1])/256 << '\n';
+	sample s {};
+	s.time = now_ns ();
+	s.device = id;
+	s.channel = channel_inner;
+	decode_temper (reading_view (d).raw (), 1, cal, &s.value, &s.flags);
+	if (s.flags & sample_invalid)
+	    link->health.reject ();
+	return s;
+    }
+};
+
+typedef std::vector<std::unique_ptr<temper_device>> temper_devices;
+
+std::vector<health_snapshot> temper_devices_snapshot (const temper_devices& devices) {
+    std::vector<health_snapshot> v;
+    for (const auto& dev: devices)
+	v.push_back (dev->link->health.snapshot ());
+    return v;
+}
+
+// A line for each device: its id, its path and its health counters, or
+// only what they went up by since a temper_devices_snapshot ().
+void temper_devices_health (std::ostream& o, const temper_devices& devices,
+	const std::vector<health_snapshot>* since = nullptr) {
+    std::vector<health_snapshot> now = temper_devices_snapshot (devices);
+    for (size_t i = 0; i < devices.size (); ++i) {
+	o << devices[i]->id << ' ' << devices[i]->path << ' ';
+	health_format (o, since ? now[i] - (*since)[i] : now[i]);
+	o << '\n';
+    }
+}
+
+// Brings up devices concurrently on the pool, so that startup takes about
+// as long as the slowest device rather than the sum of them all. open (i)
+// gives the transport to found[i]. A device that fails is reported and left
+// out. Devices whose identity is in known skip the type probe.
+temper_devices temper_devices_start (worker_pool& pool, const std::vector<device_identity>& found,
+	std::function<std::unique_ptr<report_transport> (size_t)> open, const std::vector<device_profile>& known) {
+    std::vector<std::promise<std::unique_ptr<temper_device>>> results (found.size ());
+    std::vector<std::future<std::unique_ptr<temper_device>>> pending;
+    for (size_t i = 0; i < found.size (); ++i) {
+	pending.push_back (results[i].get_future ());
+	const device_profile* profile = nullptr;
+	for (const device_profile& p: known)
+	    if (p.identity == found[i])
+		profile = &p;
+	pool.post ([&pool, &found, &open, &results, i, profile] {
+	    try {
+		results[i].set_value (std::unique_ptr<temper_device> (
+		    new temper_device (pool, open (i), i, found[i], profile)));
+	    } catch (...) {
+		results[i].set_exception (std::current_exception ());
+	    }
+	});
+    }
+
+    temper_devices devices;
+    for (size_t i = 0; i < pending.size (); ++i) {
+	try {
+	    devices.push_back (pending[i].get ());
+	} catch (const std::exception& e) {
+	    log_line ().field ("device", found[i].path).field ("op", "open") << "cannot open: " << e;
+	}
+    }
+    if (devices.empty ())
+	throw std::runtime_error ("no device could be initialised");
+    return devices;
+}
+
+// Every attached TEMPer.
+temper_devices temper_devices_open (libusb_context* usb, worker_pool& pool,
+	const std::vector<device_profile>& known = {}) {
+    auto list = usb_device_list (usb);
+    auto found = usb_devices_find (list.first.get (), list.second, 0x1130, 0x660c);
+    if (found.empty ())
+	throw std::runtime_error ("could not find device");
+
+    std::vector<device_identity> ids;
+    for (const usb_device_found& f: found)
+	ids.push_back (f.identity);
+    return temper_devices_start (pool, ids, [&found] (size_t i) {
+	return std::unique_ptr<report_transport> (new usb_transport (usb_device_open (found[i].dev)));
+    }, known);
+}
+
+// n simulated TEMPers on bus, with the paths sim-0, sim-1...
+temper_devices temper_devices_simulate (sim_bus& bus, worker_pool& pool, unsigned n,
+	const std::vector<device_profile>& known = {}) {
+    std::vector<device_identity> ids;
+    for (unsigned i = 0; i < n; ++i)
+	ids.push_back ({"sim-" + std::to_string (i), 0x1130, 0x660c, 0, uint8_t (i + 1)});
+    return temper_devices_start (pool, ids, [&bus] (size_t i) { return bus.device (i); }, known);
+}
+
+enum poll_model {
+    model_async,
+    model_threads
+};
+
+const char* poll_model_name (poll_model m) {
+    return m == model_threads ? "threads" : "async";
+}
+
+poll_model parse_poll_model (const std::string& s) {
+    if (s == "async")
+	return model_async;
+    if (s == "threads")
+	return model_threads;
+    throw std::runtime_error ("bad model: " + s);
+}
+
+struct options {
+    std::string command;        // empty to take a single reading
+    history_config history;
+    std::string ring;
+    uint32_t ring_size = 65536;
+    std::chrono::nanoseconds since {0};
+    bool columnar = false;
+    calibration cal;
+    output_format format = format_plain;
+    bool format_given = false;
+    int decimals = 3;
+    bool streaming = false;     // --interval or --count given
+    std::chrono::nanoseconds interval {0};
+    uint64_t count = 0;         // zero for no limit
+    std::string socket;
+    std::chrono::nanoseconds idle_exit {0};     // zero to serve until stopped
+    std::string state;
+    bool align = false;
+    align_method alignment = align_last;
+    std::chrono::nanoseconds grid {0};          // zero for opt.interval
+    std::vector<derived_spec> derived;
+    realtime_config realtime;
+    bool jitter = false;        // report reading latency; implied by --realtime
+    std::vector<unsigned> simulate;     // device counts; empty for real devices
+    std::vector<poll_model> models;     // for serve, the first
+    bool health = false;        // report device health counters when done
+};
+
+void usage (std::ostream& o) {
+    o << "usage: temper [--interval DURATION] [--count N]\n"
+	"              [--format FORMAT] [--decimals N] [--calibrate GAIN,OFFSET]\n"
+	"              [--history DIR] [--ring FILE [--ring-size N]]\n"
+	"              [--align METHOD [--grid DURATION]] [--derive [DEVICE:]NAME=EXPR]...\n"
+	"              [--realtime[=PRIORITY]] [--cpu N] [--jitter] [--health]\n"
+	"       temper compact --history DIR [--retention AGE] [--rollup-after AGE]\n"
+	"                      [--rollup-width DURATION] [--rate BYTES] [--interval DURATION]\n"
+	"       temper recent --ring FILE [--since AGE] [--format FORMAT] [--decimals N]\n"
+	"       temper export --history DIR [--since AGE] [--columnar]\n"
+	"       temper serve --socket PATH [--interval DURATION] [--format FORMAT]\n"
+	"                    [--decimals N] [--calibrate GAIN,OFFSET]\n"
+	"                    [--idle-exit DURATION] [--state FILE] [--model MODEL]\n"
+	"                    [--health]\n"
+	"                    [--history DIR] [--ring FILE [--ring-size N]]\n"
+	"       temper bench [--simulate N[,N...]] [--model MODEL[,MODEL...]]\n"
+	"                    [--interval DURATION] [--count N]\n"
+	"                    [--history DIR] [--ring FILE [--ring-size N]]\n"
+	"\n"
+	"  --interval DURATION     read every DURATION until stopped or --count readings;\n"
+	"                          for compact, keep compacting every DURATION\n"
+	"  --count N               stop after N readings (default: 1 without --interval)\n"
+	"  --format FORMAT         plain, csv, json or binary (default: plain for a single\n"
+	"                          reading, csv otherwise)\n"
+	"  --decimals N            digits after the decimal point, 0 to 3 (default: 3)\n"
+	"  --calibrate GAIN,OFFSET correct readings to GAIN * reading + OFFSET\n"
+	"  --history DIR           append readings to the history in DIR\n"
+	"  --ring FILE             keep recent readings in the shared ring FILE\n"
+	"  --ring-size N           number of readings the ring holds (default: 65536)\n"
+	"  --since AGE             only show or export readings newer than AGE\n"
+	"  --columnar              export column chunks for analytics instead of segments\n"
+	"  --align METHOD          output every device's reading at each grid tick, by\n"
+	"                          last value, linear interpolation or mean; needs\n"
+	"                          --interval or --count\n"
+	"  --grid DURATION         the alignment grid's step (default: the interval)\n"
+	"  --derive [DEVICE:]NAME=EXPR\n"
+	"                          also output channel NAME, computed by EXPR for every\n"
+	"                          device or for DEVICE alone; see expr.h\n"
+	"  --realtime[=PRIORITY]   read with SCHED_FIFO priority PRIORITY (default: 10)\n"
+	"                          and locked memory, one device at a time; needs\n"
+	"                          --interval or --count\n"
+	"  --cpu N                 with --realtime, pin reading to CPU N\n"
+	"  --jitter                report how late each reading was taken, when done\n"
+	"  --health                report each device's transfers, errors, retries and\n"
+	"                          rejected readings, when done; see health.h\n"
+	"  --socket PATH           serve readings on the unix socket PATH; see server.h.\n"
+	"                          Not needed when started by socket activation\n"
+	"  --idle-exit DURATION    exit once there have been no clients for DURATION\n"
+	"  --state FILE            keep device types and the latest readings in FILE\n"
+	"                          across runs, for a quicker start\n"
+	"  --simulate N[,N...]     use N simulated devices instead of real ones; bench\n"
+	"                          runs the daemon's path once for each N given\n"
+	"  --model MODEL           read with asynchronous transfers on one thread\n"
+	"                          (async, the default) or with blocking transfers on\n"
+	"                          a thread per device (threads)\n"
+	"  --retention AGE         delete history older than AGE (default: keep)\n"
+	"  --rollup-after AGE      downsample raw history older than AGE (default: never)\n"
+	"  --rollup-width DURATION width of a rollup bucket (default: 1m)\n"
+	"  --rate BYTES            compaction I/O per second, k/M/G suffixes (default: 1M)\n"
+	"\n"
+	"bench polls the devices as serve does, for --count ticks (default: 10), with\n"
+	"one subscriber, once with each model (default: both), and reports throughput,\n"
+	"read and delivery latency, CPU time, context switches and memory. Without\n"
+	"--simulate, it first times each step of opening and reading the attached\n"
+	"devices --count times, and their readings per second back to back.\n"
+	"\n"
+	"Durations are integers with an ms, s, m, h or d suffix.\n";
+}
+
+std::chrono::nanoseconds parse_duration (const std::string& s) {
+    static const std::pair<const char*, std::chrono::nanoseconds> units[] = {
+	{"ms", std::chrono::milliseconds (1)},
+	{"s", std::chrono::seconds (1)},
+	{"m", std::chrono::minutes (1)},
+	{"h", std::chrono::hours (1)},
+	{"d", std::chrono::hours (24)}
+    };
+    size_t end = 0;
+    long long n = -1;
+    try {
+	n = std::stoll (s, &end);
+    } catch (const std::logic_error&) {
+    }
+    for (const auto& u: units)
+	if (n >= 0 && s.compare (end, std::string::npos, u.first) == 0)
+	    return n * u.second;
+    throw std::runtime_error ("bad duration: " + s);
+}
+
+size_t parse_size (const std::string& s) {
+    size_t end = 0;
+    long long n = -1;
+    try {
+	n = std::stoll (s, &end);
+    } catch (const std::logic_error&) {
+    }
+    std::string suffix = s.substr (end);
+    int shift = suffix.empty () ? 0 : suffix == "k" ? 10 : suffix == "M" ? 20 : suffix == "G" ? 30 : -1;
+    if (n < 0 || shift < 0)
+	throw std::runtime_error ("bad size: " + s);
+    return size_t (n) << shift;
+}
+
+std::vector<unsigned> parse_counts (const std::string& s) {
+    std::vector<unsigned> v;
+    std::istringstream in (s);
+    std::string item;
+    while (std::getline (in, item, ',')) {
+	size_t end = 0;
+	unsigned long n = 0;
+	try {
+	    n = std::stoul (item, &end);
+	} catch (const std::logic_error&) {
+	}
+	if (n == 0 || n > 65535 || end != item.size ())
+	    throw std::runtime_error ("bad device count: " + item);
+	v.push_back (n);
+    }
+    if (v.empty ())
+	throw std::runtime_error ("bad device count: " + s);
+    return v;
+}
+
+calibration parse_calibration (const std::string& s) {
+    calibration cal;
+    char comma;
+    std::istringstream in (s);
+    in.imbue (std::locale::classic ());
+    if (!(in >> cal.gain >> comma >> cal.offset) || comma != ',' || in.peek () != EOF)
+	throw std::runtime_error ("bad calibration: " + s);
+    return cal;
+}
+
+options parse_options (int argc, char* argv[]) {
+    enum {
+	opt_history = 256, opt_retention, opt_rollup_after, opt_rollup_width, opt_rate, opt_interval,
+	opt_ring, opt_ring_size, opt_since, opt_columnar, opt_calibrate, opt_format, opt_decimals,
+	opt_count, opt_socket, opt_realtime, opt_cpu, opt_jitter, opt_idle_exit, opt_state,
+	opt_align, opt_grid, opt_derive, opt_simulate, opt_model, opt_health
+    };
+    static const option longopts[] = {
+	{"help", no_argument, nullptr, 'h'},
+	{"history", required_argument, nullptr, opt_history},
+	{"retention", required_argument, nullptr, opt_retention},
+	{"rollup-after", required_argument, nullptr, opt_rollup_after},
+	{"rollup-width", required_argument, nullptr, opt_rollup_width},
+	{"rate", required_argument, nullptr, opt_rate},
+	{"interval", required_argument, nullptr, opt_interval},
+	{"ring", required_argument, nullptr, opt_ring},
+	{"ring-size", required_argument, nullptr, opt_ring_size},
+	{"since", required_argument, nullptr, opt_since},
+	{"columnar", no_argument, nullptr, opt_columnar},
+	{"calibrate", required_argument, nullptr, opt_calibrate},
+	{"format", required_argument, nullptr, opt_format},
+	{"decimals", required_argument, nullptr, opt_decimals},
+	{"count", required_argument, nullptr, opt_count},
+	{"socket", required_argument, nullptr, opt_socket},
+	{"realtime", optional_argument, nullptr, opt_realtime},
+	{"cpu", required_argument, nullptr, opt_cpu},
+	{"jitter", no_argument, nullptr, opt_jitter},
+	{"idle-exit", required_argument, nullptr, opt_idle_exit},
+	{"state", required_argument, nullptr, opt_state},
+	{"align", required_argument, nullptr, opt_align},
+	{"grid", required_argument, nullptr, opt_grid},
+	{"derive", required_argument, nullptr, opt_derive},
+	{"simulate", required_argument, nullptr, opt_simulate},
+	{"model", required_argument, nullptr, opt_model},
+	{"health", no_argument, nullptr, opt_health},
+	{nullptr, 0, nullptr, 0}
+    };
+
+    options opt;
+    int c;
+    while ((c = getopt_long (argc, argv, "h", longopts, nullptr)) != -1) {
+	switch (c) {
+	case 'h':
+	    usage (std::cout);
+	    std::exit (EXIT_SUCCESS);
+	case opt_history:       opt.history.dir = optarg; break;
+	case opt_retention:     opt.history.retention = parse_duration (optarg); break;
+	case opt_rollup_after:  opt.history.rollup_after = parse_duration (optarg); break;
+	case opt_rollup_width:  opt.history.rollup_width = parse_duration (optarg); break;
+	case opt_rate:          opt.history.rate = parse_size (optarg); break;
+	case opt_interval:
+	    opt.interval = parse_duration (optarg);
+	    opt.streaming = true;
+	    break;
+	case opt_count:
+	    opt.count = std::stoull (optarg);
+	    opt.streaming = true;
+	    break;
+	case opt_ring:          opt.ring = optarg; break;
+	case opt_socket:        opt.socket = optarg; break;
+	case opt_idle_exit:     opt.idle_exit = parse_duration (optarg); break;
+	case opt_state:         opt.state = optarg; break;
+	case opt_align:
+	    opt.alignment = parse_align_method (optarg);
+	    opt.align = true;
+	    break;
+	case opt_grid:          opt.grid = parse_duration (optarg); break;
+	case opt_derive:        opt.derived.push_back (parse_derived_spec (optarg)); break;
+	case opt_simulate:      opt.simulate = parse_counts (optarg); break;
+	case opt_model: {
+	    std::istringstream in (optarg);
+	    std::string m;
+	    while (std::getline (in, m, ','))
+		opt.models.push_back (parse_poll_model (m));
+	    break;
+	}
+	case opt_ring_size:
+	    opt.ring_size = parse_size (optarg);
+	    if (opt.ring_size == 0 || opt.ring_size != parse_size (optarg))
+		throw std::runtime_error ("bad ring size: " + std::string (optarg));
+	    break;
+	case opt_since:         opt.since = parse_duration (optarg); break;
+	case opt_columnar:      opt.columnar = true; break;
+	case opt_calibrate:     opt.cal = parse_calibration (optarg); break;
+	case opt_format:
+	    opt.format = parse_output_format (optarg);
+	    opt.format_given = true;
+	    break;
+	case opt_decimals:
+	    opt.decimals = std::stoi (optarg);
+	    if (opt.decimals < 0 || opt.decimals > 3)
+		throw std::runtime_error ("--decimals must be between 0 and 3");
+	    break;
+	case opt_realtime:
+	    opt.realtime.enabled = true;
+	    opt.jitter = true;
+	    if (optarg) {
+		opt.realtime.priority = std::stoi (optarg);
+		if (opt.realtime.priority < 1 || opt.realtime.priority > 99)
+		    throw std::runtime_error ("--realtime priority must be between 1 and 99");
+	    }
+	    break;
+	case opt_cpu:
+	    opt.realtime.cpu = std::stoi (optarg);
+	    if (opt.realtime.cpu < 0)
+		throw std::runtime_error ("bad CPU: " + std::string (optarg));
+	    break;
+	case opt_jitter:        opt.jitter = true; break;
+	case opt_health:        opt.health = true; break;
+	default:
+	    usage (std::cerr);
+	    std::exit (EXIT_FAILURE);
+	}
+    }
+    if (optind < argc)
+	opt.command = argv[optind++];
+    if (optind < argc || (!opt.command.empty () && opt.command != "compact" && opt.command != "recent"
+	    && opt.command != "export" && opt.command != "serve" && opt.command != "bench")) {
+	usage (std::cerr);
+	std::exit (EXIT_FAILURE);
     }
+    if ((opt.command == "compact" || opt.command == "export") && opt.history.dir.empty ())
+	throw std::runtime_error (opt.command + " needs --history");
+    if (opt.command == "recent" && opt.ring.empty ())
+	throw std::runtime_error ("recent needs --ring");
+    if (opt.command == "serve" && opt.socket.empty () && !std::getenv ("LISTEN_FDS"))
+	throw std::runtime_error ("serve needs --socket, or socket activation");
+    if (opt.command != "bench" && opt.simulate.size () > 1)
+	throw std::runtime_error ("only bench takes more than one --simulate count");
+    if (!opt.simulate.empty () && (opt.command == "compact" || opt.command == "recent" || opt.command == "export"))
+	throw std::runtime_error ("--simulate is only for reading devices");
+    if (opt.health && !opt.command.empty () && opt.command != "serve" && opt.command != "bench")
+	throw std::runtime_error ("--health is only for reading devices");
+    if (!opt.models.empty () && opt.command != "serve" && opt.command != "bench")
+	throw std::runtime_error ("--model is only for serve and bench");
+    if (opt.command == "serve" && opt.models.size () > 1)
+	throw std::runtime_error ("serve takes one --model");
+    if (opt.models.empty ())
+	opt.models = opt.command == "bench" ? std::vector<poll_model> {model_async, model_threads}
+	    : std::vector<poll_model> {model_async};
+    if ((opt.realtime.enabled || opt.jitter) && (!opt.streaming || !opt.command.empty ()))
+	throw std::runtime_error ("--realtime and --jitter need --interval or --count");
+    if ((opt.align || opt.grid.count ()) && (!opt.streaming || !opt.command.empty ()))
+	throw std::runtime_error ("--align and --grid need --interval or --count");
+    if (opt.grid.count () && !opt.align)
+	throw std::runtime_error ("--grid needs --align");
+    if (!opt.derived.empty () && !opt.command.empty ())
+	throw std::runtime_error ("--derive is only for readings to stdout");
+    if ((opt.idle_exit.count () || !opt.state.empty ()) && opt.command != "serve")
+	throw std::runtime_error ("--idle-exit and --state need serve");
+    if (opt.realtime.cpu >= 0 && !opt.realtime.enabled)
+	throw std::runtime_error ("--cpu needs --realtime");
+    if ((opt.command == "recent" || opt.command == "serve" || opt.streaming) && !opt.format_given)
+	opt.format = format_csv;
+    if ((opt.command == "serve" || opt.command == "bench" || opt.streaming)
+	    && opt.interval <= std::chrono::nanoseconds::zero ())
+	opt.interval = std::chrono::seconds (1);
+    if (opt.command == "bench" && !opt.count)
+	opt.count = 10;
+    if (opt.align && opt.grid <= std::chrono::nanoseconds::zero ())
+	opt.grid = opt.interval;
+    if (opt.history.rollup_width <= std::chrono::nanoseconds::zero ())
+	throw std::runtime_error ("--rollup-width must be positive");
+    return opt;
+}
+
+int compact (const options& opt) {
+    history_config cfg = opt.history;
+    cfg.interval = opt.interval;
+    compactor c (cfg);
+    if (!opt.streaming) {
+	compaction_stats s = c.run_once ();
+	std::cout << "merged " << s.merged << ", rolled up " << s.rolled_up
+	    << ", expired " << s.expired << " segments; " << s.bytes << " bytes\n";
+	return EXIT_SUCCESS;
+    }
+
+    // block the signals before the compaction thread inherits our mask
+    sigset_t stop;
+    sigemptyset (&stop);
+    sigaddset (&stop, SIGINT);
+    sigaddset (&stop, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &stop, nullptr);
+    c.start ();
+    int sig;
+    sigwait (&stop, &sig);
+    return EXIT_SUCCESS;
+}
 
+int recent (const options& opt) {
+    ring_reader r (opt.ring);
+    std::vector<sample> v (r.capacity ());
+    v.resize (r.recent (v.data (), v.size ()));
+    int64_t cutoff = opt.since.count () ? now_ns () - opt.since.count () : INT64_MIN;
+    sample_output out (STDOUT_FILENO, opt.format, opt.decimals);
+    for (const sample& s: v)
+	if (s.time >= cutoff)
+	    out.write (s);
+    out.flush ();
     return EXIT_SUCCESS;
+}
+
+// Segments or column chunks to stdout, for offline analysis; see export.h.
+int export_history (const options& opt) {
+    int64_t from = opt.since.count () ? now_ns () - opt.since.count () : INT64_MIN;
+    if (opt.columnar) {
+	columnar_export (STDOUT_FILENO, opt.history.dir, from, INT64_MAX);
+	return EXIT_SUCCESS;
+    }
+    history_export e (opt.history.dir, from, INT64_MAX);
+    while (!e.pump (STDOUT_FILENO)) {
+	pollfd p = {STDOUT_FILENO, POLLOUT, 0};
+	posix_check (poll (&p, 1, -1), "poll");
+    }
+    return EXIT_SUCCESS;
+}
+
+// The history, with its compaction, and the ring, written on a sink thread
+// so that the disk cannot delay a reading. Either may be left out.
+struct storage_sinks {
+    std::unique_ptr<history_writer> history;
+    std::unique_ptr<ring_writer> ring;
+    std::unique_ptr<compactor> compaction;
+    std::unique_ptr<sink_thread> thread;
+
+    explicit storage_sinks (const options& opt) {
+	if (!opt.history.dir.empty ()) {
+	    history.reset (new history_writer (opt.history));
+	    compaction.reset (new compactor (opt.history));
+	    compaction->start ();
+	}
+	if (!opt.ring.empty ())
+	    ring.reset (new ring_writer (opt.ring, opt.ring_size));
+	if (history || ring) {
+	    thread.reset (new sink_thread ([this] (const std::vector<sample>& v) {
+		if (history)
+		    history->append (v.data (), v.size ());
+		if (ring)
+		    for (const sample& s: v)
+			ring->append (s);
+	    }));
+	}
+    }
+
+    ~storage_sinks () {
+	close ();
+    }
+
+    template <typename T>
+    void push (const T& v) {
+	if (thread)
+	    thread->push (v);
+    }
+
+    bool failed () const {
+	return thread && thread->failed ();
+    }
+
+    void close () {
+	if (thread)
+	    thread->close ();
+	if (compaction)
+	    compaction->stop ();
+    }
+
+    void rethrow () const {
+	if (failed ())
+	    std::rethrow_exception (thread->error ());
+    }
+};
+
+// The channels from --derive, for the devices present; null if none.
+std::unique_ptr<derived_channels> derived_open (const temper_devices& devices, const options& opt) {
+    if (opt.derived.empty ())
+	return nullptr;
+    std::vector<uint16_t> ids;
+    for (const auto& dev: devices)
+	ids.push_back (dev->id);
+    return std::unique_ptr<derived_channels> (new derived_channels (opt.derived, ids));
+}
+
+volatile sig_atomic_t stop_signal = 0;
+
+extern "C" void on_stop_signal (int sig) {
+    stop_signal = sig;
+}
+
+// Reads every device on its own strand, so they proceed in parallel, and
+// waits for them all; or, if here, reads them one after another on this
+// thread, which the strands must then leave alone. A device that fails is
+// reported and contributes nothing this time; callers tell from the result
+// being short.
+std::vector<sample> temper_devices_read (const temper_devices& devices, const calibration& cal,
+	bool here = false) {
+    std::vector<sample> v;
+    if (here) {
+	for (const auto& dev: devices) {
+	    try {
+		v.push_back (dev->read (cal));
+	    } catch (const std::exception& e) {
+		log_line ().field ("device", dev->path).field ("op", "read") << "cannot read: " << e;
+	    }
+	}
+	return v;
+    }
+
+    std::vector<std::promise<sample>> results (devices.size ());
+    std::vector<std::future<sample>> pending;
+    for (size_t i = 0; i < devices.size (); ++i) {
+	pending.push_back (results[i].get_future ());
+	temper_device& dev = *devices[i];
+	std::promise<sample>& p = results[i];
+	dev.io.post ([&dev, &p, &cal] {
+	    try {
+		p.set_value (dev.read (cal));
+	    } catch (...) {
+		p.set_exception (std::current_exception ());
+	    }
+	});
+    }
+
+    for (size_t i = 0; i < pending.size (); ++i) {
+	try {
+	    v.push_back (pending[i].get ());
+	} catch (const std::exception& e) {
+	    log_line ().field ("device", devices[i]->path).field ("op", "read") << "cannot read: " << e;
+	}
+    }
+    return v;
+}
+
+// Reads on a fixed grid of opt.interval until opt.count readings, SIGINT
+// or SIGTERM, or the consumer going away. Output and storage run on sink
+// threads, so neither a slow pipe nor the disk can delay a reading; ticks
+// lost to a slow device are skipped rather than made up in a burst. With
+// --realtime, main () has already made this thread real-time, and pinned
+// it, and the devices are read here rather than on the workers, so that
+// the transfers are real-time too; the sinks run with normal scheduling.
+// Jitter is how late each reading was taken, from its tick to its
+// timestamp, which is taken once its transfer is done.
+int stream (const temper_devices& devices, const options& opt) {
+    std::signal (SIGPIPE, SIG_IGN);
+    struct sigaction sa {};
+    sa.sa_handler = on_stop_signal;     // no SA_RESTART, to cut the sleep short
+    sigaction (SIGINT, &sa, nullptr);
+    sigaction (SIGTERM, &sa, nullptr);
+
+    std::unique_ptr<derived_channels> derived = derived_open (devices, opt);
+    sample_output out (STDOUT_FILENO, opt.format, opt.decimals);
+    if (derived)
+	out.name_channels (derived->names ());
+    sink_thread output ([&out] (const std::vector<sample>& v) {
+	for (const sample& s: v)
+	    out.write (s);
+	out.flush ();
+    });
+
+    storage_sinks storage (opt);
+
+    // with --align, output gets the grid's rows and storage the readings;
+    // derived channels are computed from whichever output gets
+    std::vector<sample> rows, extra;
+    std::unique_ptr<aligner> align;
+    if (opt.align) {
+	std::vector<aligner::column> columns;
+	for (const auto& dev: devices)
+	    columns.push_back (aligner::column (dev->id, channel_inner));
+	align.reset (new aligner (columns, opt.grid, opt.grid + opt.interval, opt.alignment,
+	    [&rows, &extra, &derived, columns] (int64_t t, const int32_t* values, const uint8_t* flags) {
+		size_t first = rows.size ();
+		for (size_t i = 0; i < columns.size (); ++i)
+		    rows.push_back (sample {t, columns[i].first, columns[i].second, flags[i], values[i]});
+		if (derived) {
+		    derived->apply (rows.data () + first, rows.data () + rows.size (), extra);
+		    rows.insert (rows.end (), extra.begin (), extra.end ());
+		    extra.clear ();
+		}
+	    }));
+    }
+
+    const int64_t interval = opt.interval.count ();
+    uint64_t taken = 0, missed = 0;
+    jitter_stats jitter;
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    int64_t next = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    while (!stop_signal && !output.failed () && !storage.failed ()) {
+	std::vector<sample> v = temper_devices_read (devices, opt.cal, opt.realtime.enabled);
+	if (opt.jitter) {
+	    // the timestamps are wall-clock time and the ticks monotonic
+	    clock_gettime (CLOCK_MONOTONIC, &ts);
+	    int64_t wall = now_ns ();
+	    int64_t mono = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	    for (const sample& s: v)
+		jitter.record (mono - (wall - s.time) - next);
+	}
+	if (align) {
+	    for (const sample& s: v)
+		align->push (s);
+	    output.push (rows);
+	    rows.clear ();
+	} else {
+	    output.push (v);
+	    if (derived) {
+		derived->apply (v.data (), v.data () + v.size (), extra);
+		output.push (extra);
+		extra.clear ();
+	    }
+	}
+	storage.push (v);
+	if (++taken == opt.count)
+	    break;
+
+	next += interval;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	int64_t now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	if (now >= next) {
+	    int64_t late = (now - next) / interval + 1;
+	    missed += late;
+	    next += late * interval;
+	}
+	ts.tv_sec = next / 1000000000;
+	ts.tv_nsec = next % 1000000000;
+	while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR && !stop_signal)
+	    ;
+    }
+
+    if (align) {
+	align->flush ();
+	output.push (rows);
+    }
+    output.close ();
+    storage.close ();
+    if (output.dropped () || missed)
+	log_line (log_warning) << output.dropped () << " readings dropped by a slow consumer, "
+	    << missed << " ticks missed";
+    log_flush ();
+    if (opt.jitter) {
+	std::cerr << "temper: ";
+	jitter.report (std::cerr);
+    }
+    if (opt.health)
+	temper_devices_health (std::cerr, devices);
+
+    storage.rethrow ();
+    if (output.failed ()) {
+	// a closed pipe is how consumers like head(1) say they are done
+	try {
+	    std::rethrow_exception (output.error ());
+	} catch (const std::system_error& e) {
+	    if (e.code () != std::errc::broken_pipe)
+		throw;
+	}
+    }
+    return EXIT_SUCCESS;
+}
+
+// Reads every device each interval and hands the readings to a handler on
+// the thread running the loop. A device still busy with the previous
+// reading when the next is due skips that tick.
+class device_poller {
+public:
+    typedef std::function<void (const sample&)> sample_handler;
+
+    virtual ~device_poller () {}
+
+    virtual void start (std::chrono::nanoseconds first, std::chrono::nanoseconds interval) = 0;
+
+    // Stops polling and hands over the readings still to come, as must
+    // happen before the devices go. Runs the loop meanwhile, so that what
+    // the handler defers to it is done too.
+    virtual void drain () = 0;
+
+    uint64_t missed = 0;        // readings skipped for busy devices
+    jitter_stats latency;       // from each tick to its readings
+};
+
+// The devices read with asynchronous transfers on the loop's own thread,
+// through whatever drives their transports there (usb_event_source,
+// sim_bus).
+class async_poller: public device_poller {
+public:
+    // submitted, if given, is called once each tick's transfers are
+    // started, as usb_event_source::update () must be.
+    async_poller (event_loop& loop, const temper_devices& devices, const calibration& cal,
+	    sample_handler handler, std::function<void ()> submitted = nullptr):
+	loop (loop),
+	devices (devices),
+	cal (cal),
+	handler (std::move (handler)),
+	submitted (std::move (submitted)),
+	busy (devices.size ()),
+	started (devices.size ()),
+	timer (loop, [this] { tick (); })
+    {}
+
+    async_poller (const async_poller&) = delete;
+    async_poller& operator= (const async_poller&) = delete;
+
+    void start (std::chrono::nanoseconds first, std::chrono::nanoseconds interval) override {
+	timer.start (first, interval);
+    }
+
+    // Runs the loop until the readings in flight are done.
+    void drain () override {
+	timer.cancel ();
+	draining = true;
+	while (in_flight)
+	    loop.run ();
+	draining = false;
+    }
+
+private:
+    void tick () {
+	int64_t now = monotonic_ns ();
+	for (size_t i = 0; i < devices.size (); ++i) {
+	    if (busy[i]) {
+		++missed;
+		continue;
+	    }
+	    // a transfer that cannot be submitted completes straight away
+	    busy[i] = true;
+	    ++in_flight;
+	    started[i] = now;
+	    spawn (devices[i]->read_co (cal), [this, i] (std::exception_ptr e, const sample& s) {
+		done (i, e, s);
+	    });
+	}
+	if (submitted)
+	    submitted ();
+    }
+
+    void done (size_t i, std::exception_ptr e, const sample& s) {
+	busy[i] = false;
+	if (!--in_flight && draining)
+	    loop.stop ();
+	if (!e) {
+	    latency.record (monotonic_ns () - started[i]);
+	    handler (s);
+	    return;
+	}
+	try {
+	    std::rethrow_exception (e);
+	} catch (const std::exception& x) {
+	    log_line ().field ("device", devices[i]->path).field ("op", "read") << "cannot read: " << x;
+	}
+    }
+
+    event_loop& loop;
+    const temper_devices& devices;
+    calibration cal;
+    sample_handler handler;
+    std::function<void ()> submitted;
+    std::vector<char> busy;
+    std::vector<int64_t> started;
+    size_t in_flight = 0;
+    bool draining = false;
+    loop_timer timer;
+};
+
+// Each device read on a thread of its own with blocking transfers, which
+// sleeps until its next tick. The readings are queued for the loop's
+// thread, which an eventfd wakes; a thread also wakes it on the way out.
+class thread_poller: public device_poller {
+public:
+    thread_poller (event_loop& loop, const temper_devices& devices, const calibration& cal,
+	    sample_handler handler):
+	loop (loop),
+	devices (devices),
+	cal (cal),
+	handler (std::move (handler)),
+	wake (posix_check (eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC), "eventfd"))
+    {
+	loop.add (wake.get (), EPOLLIN, [this] (uint32_t) {
+	    uint64_t n;
+	    while (::read (wake.get (), &n, sizeof n) < 0 && errno == EINTR)
+		;
+	    if (!deliver () && draining)
+		this->loop.stop ();
+	});
+    }
+
+    ~thread_poller () {
+	stop ();
+	loop.remove (wake.get ());
+    }
+
+    thread_poller (const thread_poller&) = delete;
+    thread_poller& operator= (const thread_poller&) = delete;
+
+    void start (std::chrono::nanoseconds first, std::chrono::nanoseconds interval) override {
+	int64_t next = monotonic_ns () + first.count ();
+	running = devices.size ();
+	for (const auto& dev: devices)
+	    threads.emplace_back ([this, &dev, next, interval] { run (*dev, next, interval.count ()); });
+    }
+
+    // Runs the loop until the threads have finished the readings under way
+    // and every reading is handled.
+    void drain () override {
+	{
+	    std::lock_guard<std::mutex> lock (m);
+	    stopping = true;
+	}
+	wakeup.notify_all ();
+	draining = true;
+	for (;;) {
+	    {
+		std::lock_guard<std::mutex> lock (m);
+		if (!running && ready.empty ())
+		    break;
+	    }
+	    loop.run ();
+	}
+	draining = false;
+	stop ();
+    }
+
+private:
+    struct reading {
+	sample s;
+	int64_t latency;
+    };
+
+    void run (temper_device& dev, int64_t next, int64_t interval) {
+	std::unique_lock<std::mutex> lock (m);
+	for (;;) {
+	    std::chrono::steady_clock::time_point due {std::chrono::nanoseconds (next)};
+	    if (wakeup.wait_until (lock, due, [this] { return stopping; }))
+		break;
+	    lock.unlock ();
+	    reading r {};
+	    std::string error;
+	    try {
+		r.s = dev.read (cal);
+		r.latency = monotonic_ns () - next;
+	    } catch (const std::exception& e) {
+		error = e.what ();
+	    }
+	    next += interval;
+	    int64_t late = 0, now = monotonic_ns ();
+	    if (now >= next) {
+		late = (now - next) / interval + 1;
+		next += late * interval;
+	    }
+	    if (!error.empty ())
+		log_line ().field ("device", dev.path).field ("op", "read") << "cannot read: " << error;
+
+	    lock.lock ();
+	    skipped += late;
+	    if (!error.empty ())
+		continue;
+	    ready.push_back (r);
+	    if (ready.size () == 1)
+		notify ();
+	}
+	--running;
+	notify ();
+    }
+
+    void notify () {
+	uint64_t one = 1;
+	posix_check (::write (wake.get (), &one, sizeof one), "eventfd");
+    }
+
+    void stop () {
+	{
+	    std::lock_guard<std::mutex> lock (m);
+	    stopping = true;
+	}
+	wakeup.notify_all ();
+	for (std::thread& t: threads)
+	    t.join ();
+	threads.clear ();
+    }
+
+    // Returns whether any thread is still running.
+    bool deliver () {
+	std::vector<reading> v;
+	bool more;
+	{
+	    std::lock_guard<std::mutex> lock (m);
+	    v.swap (ready);
+	    missed = skipped;
+	    more = running;
+	}
+	for (const reading& r: v) {
+	    latency.record (r.latency);
+	    handler (r.s);
+	}
+	return more;
+    }
+
+    event_loop& loop;
+    const temper_devices& devices;
+    calibration cal;
+    sample_handler handler;
+    unique_fd wake;
+    std::vector<std::thread> threads;
+    bool draining = false;
+
+    std::mutex m;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    size_t running = 0;                 // threads not yet on their way out
+    std::vector<reading> ready;
+    uint64_t skipped = 0;
+};
+
+std::unique_ptr<device_poller> poller_open (poll_model model, event_loop& loop, const temper_devices& devices,
+	const calibration& cal, device_poller::sample_handler handler, std::function<void ()> submitted = nullptr) {
+    if (model == model_threads)
+	return std::unique_ptr<device_poller> (new thread_poller (loop, devices, cal, std::move (handler)));
+    return std::unique_ptr<device_poller> (new async_poller (loop, devices, cal, std::move (handler),
+	std::move (submitted)));
+}
+
+// A daemon: one event loop drives libusb, or the simulated devices' sim,
+// reads every device each opt.interval with asynchronous transfers, and
+// serves the readings on opt.socket or a socket-activated listener, all on
+// this thread; with --model threads, each device is read on a thread of
+// its own instead. state is what --state held, and is rewritten on exit.
+int serve (libusb_context* usb, sim_bus* sim, const temper_devices& devices, const daemon_state& state,
+	const options& opt) {
+    std::signal (SIGPIPE, SIG_IGN);
+    event_loop loop;
+    loop_signals signals (loop, {SIGINT, SIGTERM}, [&loop] (int) { loop.stop (); });
+
+    storage_sinks storage (opt);
+    std::unique_ptr<usb_event_source> events;
+    if (usb)
+	events.reset (new usb_event_source (usb, loop));
+    std::unique_ptr<sim_bus::attachment> simulation;
+    if (sim)
+	simulation.reset (new sim_bus::attachment (*sim, loop));
+    server_config sc;
+    sc.socket = opt.socket;
+    sc.listen_fd = systemd_listen_fd ();
+    sc.history = opt.history.dir;
+    sc.format = opt.format;
+    sc.decimals = opt.decimals;
+    sc.health = [&devices] (std::ostream& o) { temper_devices_health (o, devices); };
+    sample_server server (loop, sc);
+
+    // the samples name devices by index, so only the same devices will do
+    bool same_devices = state.devices.size () == devices.size ();
+    for (size_t i = 0; same_devices && i < devices.size (); ++i)
+	same_devices = state.devices[i].identity == devices[i]->profile.identity;
+    if (same_devices)
+	for (const sample& s: state.latest)
+	    server.publish (s);
+
+    loop_timer idle (loop, [&] {
+	if (server.idle_for (opt.idle_exit))
+	    loop.stop ();
+    });
+    if (opt.idle_exit.count ())
+	idle.start (opt.idle_exit, std::min<std::chrono::nanoseconds> (opt.idle_exit, std::chrono::seconds (1)));
+
+    std::unique_ptr<device_poller> poller = poller_open (opt.models[0], loop, devices, opt.cal, [&] (const sample& s) {
+	server.publish (s);
+	storage.push (s);
+	if (storage.failed ())
+	    loop.stop ();
+    }, [&events] {
+	if (events)
+	    events->update ();
+    });
+    poller->start (std::chrono::nanoseconds (0), opt.interval);
+
+    loop.run ();
+
+    // the handles must not be closed under transfers still in flight
+    poller->drain ();
+    storage.close ();
+    if (poller->missed)
+	log_line (log_warning) << poller->missed << " readings skipped for busy devices";
+    log_flush ();
+    if (opt.health)
+	temper_devices_health (std::cerr, devices);
+    if (!opt.state.empty ()) {
+	daemon_state next;
+	for (const auto& dev: devices)
+	    next.devices.push_back (dev->profile);
+	next.latest = server.snapshot ();
+	save_state (opt.state, next);
+    }
+    storage.rethrow ();
+    return EXIT_SUCCESS;
+}
+
+// One subscriber to a sample_server, reading binary samples on a thread of
+// its own, as an external client would, and timing their delivery.
+class bench_subscriber {
+public:
+    explicit bench_subscriber (const std::string& socket):
+	fd (posix_check (::socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), "socket"))
+    {
+	sockaddr_un a {};
+	a.sun_family = AF_UNIX;
+	if (socket.size () >= sizeof a.sun_path)
+	    throw std::runtime_error ("socket path too long: " + socket);
+	std::copy (socket.begin (), socket.end (), a.sun_path);
+	posix_check (connect (fd.get (), reinterpret_cast<sockaddr*> (&a), sizeof a), "connect " + socket);
+	static const char request[] = "subscribe binary slow=drop\n";
+	write_all (fd.get (), request, sizeof request - 1, "subscribe");
+	thread = std::thread ([this] { run (); });
+    }
+
+    // Hangs up first if the server has not.
+    ~bench_subscriber () {
+	if (thread.joinable ()) {
+	    shutdown (fd.get (), SHUT_RDWR);
+	    thread.join ();
+	}
+    }
+
+    // Once the server has closed the connection.
+    void join () {
+	thread.join ();
+    }
+
+    uint64_t received = 0;
+    jitter_stats delivery;      // from each reading to its arrival here
+
+private:
+    void run () {
+	std::vector<char> buf (65536);
+	size_t have = 0;
+	for (;;) {
+	    ssize_t r = ::read (fd.get (), buf.data () + have, buf.size () - have);
+	    if (r < 0 && errno == EINTR)
+		continue;
+	    if (r <= 0)
+		return;
+	    int64_t now = now_ns ();
+	    have += r;
+	    size_t n = have / sizeof (sample);
+	    for (size_t i = 0; i < n; ++i) {
+		sample s;
+		std::memcpy (&s, buf.data () + i * sizeof s, sizeof s);
+		delivery.record (now - s.time);
+	    }
+	    received += n;
+	    have -= n * sizeof (sample);
+	    std::memmove (buf.data (), buf.data () + n * sizeof (sample), have);
+	}
+    }
+
+    unique_fd fd;
+    std::thread thread;
+};
+
+size_t resident_bytes () {
+    std::ifstream in ("/proc/self/statm");
+    size_t size = 0, resident = 0;
+    in >> size >> resident;
+    return resident * sysconf (_SC_PAGESIZE);
+}
+
+double cpu_seconds (const rusage& u) {
+    return u.ru_utime.tv_sec + u.ru_stime.tv_sec + (u.ru_utime.tv_usec + u.ru_stime.tv_usec) / 1e6;
+}
+
+// serve ()'s path, from the transfers through a subscriber and storage,
+// for opt.count ticks, reported on stdout.
+void bench_run (libusb_context* usb, sim_bus* sim, const temper_devices& devices, poll_model model,
+	const options& opt) {
+    std::string socket = opt.socket.empty () ? "/tmp/temper-bench." + std::to_string (getpid ()) : opt.socket;
+    event_loop loop;
+    std::unique_ptr<usb_event_source> events;
+    if (usb)
+	events.reset (new usb_event_source (usb, loop));
+    std::unique_ptr<sim_bus::attachment> simulation;
+    if (sim)
+	simulation.reset (new sim_bus::attachment (*sim, loop));
+    storage_sinks storage (opt);
+    server_config sc;
+    sc.socket = socket;
+    sc.format = format_binary;
+    std::unique_ptr<sample_server> server (new sample_server (loop, sc));
+    bench_subscriber subscriber (socket);
+    uint64_t published = 0;
+    std::unique_ptr<device_poller> poller = poller_open (model, loop, devices, opt.cal, [&] (const sample& s) {
+	server->publish (s);
+	storage.push (s);
+	++published;
+    }, [&events] {
+	if (events)
+	    events->update ();
+    });
+    loop_timer end (loop, [&loop] { loop.stop (); });
+
+    // the devices carry their counters from run to run
+    std::vector<health_snapshot> health = temper_devices_snapshot (devices);
+    rusage before, after;
+    getrusage (RUSAGE_SELF, &before);
+    int64_t t0 = monotonic_ns ();
+    // a tick's grace for the subscription to be set up, then opt.count
+    // ticks and half an interval for the last to finish
+    poller->start (opt.interval, opt.interval);
+    end.start (opt.interval * opt.count + opt.interval / 2);
+    loop.run ();
+    poller->drain ();
+    int64_t elapsed = monotonic_ns () - t0;
+    getrusage (RUSAGE_SELF, &after);
+    size_t rss = resident_bytes ();
+
+    // let the subscriber have the rest, then hang up on it
+    server.reset ();
+    subscriber.join ();
+    storage.close ();
+    storage.rethrow ();
+
+    auto ms = [] (int64_t ns) { return ns / 1e6; };
+    double cpu = cpu_seconds (after) - cpu_seconds (before);
+    std::cout << devices.size () << " devices, " << poll_model_name (model) << ": "
+	<< published * 1e9 / elapsed << " readings/s, "
+	<< published << " read, " << subscriber.received << " delivered, "
+	<< poller->missed << " skipped\n"
+	<< "  read (ms): p50 " << ms (poller->latency.quantile (0.5))
+	<< ", p99 " << ms (poller->latency.quantile (0.99))
+	<< ", p99.9 " << ms (poller->latency.quantile (0.999))
+	<< ", max " << ms (poller->latency.max ()) << '\n'
+	<< "  delivery (ms): p50 " << ms (subscriber.delivery.quantile (0.5))
+	<< ", p99 " << ms (subscriber.delivery.quantile (0.99))
+	<< ", p99.9 " << ms (subscriber.delivery.quantile (0.999))
+	<< ", max " << ms (subscriber.delivery.max ()) << '\n'
+	<< "  cpu " << cpu << " s (" << 100 * cpu * 1e9 / elapsed << "% of one core), "
+	<< after.ru_nvcsw - before.ru_nvcsw << " voluntary and "
+	<< after.ru_nivcsw - before.ru_nivcsw << " involuntary context switches, "
+	<< "rss " << rss / 1048576.0 << " MiB\n";
+    if (opt.health)
+	temper_devices_health (std::cout, devices, &health);
+}
+
+void bench_report (std::ostream& o, const char* what, const jitter_stats& st) {
+    auto ms = [] (int64_t ns) { return ns / 1e6; };
+    o << "  " << std::left << std::setw (18) << what << std::right
+	<< "min " << std::setw (8) << ms (st.min ())
+	<< "  p50 " << std::setw (8) << ms (st.quantile (0.5))
+	<< "  p90 " << std::setw (8) << ms (st.quantile (0.9))
+	<< "  p99 " << std::setw (8) << ms (st.quantile (0.99))
+	<< "  max " << std::setw (8) << ms (st.max ()) << '\n';
+}
+
+// Times each step of bringing up and reading the attached devices,
+// opt.count times over, then opt.count readings back to back from each.
+// The steps are those of temper_devices_open () and temper_device, done
+// here one by one, so that a slow hub, driver or firmware shows up in the
+// step it slows.
+void bench_phases (libusb_context* usb, const options& opt) {
+    enum { phase_open, phase_detach, phase_configure, phase_claim, phase_probe, phase_read, phases };
+    static const char* const names[phases] = {
+	"open", "detach", "set configuration", "claim", "devtype probe", "read"
+    };
+    jitter_stats enumeration;
+    std::map<std::string, std::array<jitter_stats, phases>> steps;     // by device path
+    auto lap = [] (int64_t& t) {
+	int64_t now = monotonic_ns ();
+	return now - std::exchange (t, now);
+    };
+
+    for (uint64_t i = 0; i < opt.count; ++i) {
+	int64_t t = monotonic_ns ();
+	auto list = usb_device_list (usb);
+	auto found = usb_devices_find (list.first.get (), list.second, 0x1130, 0x660c);
+	enumeration.record (lap (t));
+	if (found.empty ())
+	    throw std::runtime_error ("could not find device");
+
+	for (const usb_device_found& f: found) {
+	    std::array<jitter_stats, phases>& st = steps[f.path];
+	    try {
+		t = monotonic_ns ();
+		std::shared_ptr<libusb_device_handle> dh = usb_device_open (f.dev);
+		st[phase_open].record (lap (t));
+		usb_attach_interface a1 (dh, 0);
+		usb_attach_interface a2 (dh, 1);
+		st[phase_detach].record (lap (t));
+		usb_set_configuration config (dh, 1);
+		st[phase_configure].record (lap (t));
+		usb_claim_interface i1 (dh, 0);
+		usb_claim_interface i2 (dh, 1);
+		st[phase_claim].record (lap (t));
+
+		usb_link link (dh);
+		msg256 buf;
+		read_data (link, cmd_devtype, buf);
+		st[phase_probe].record (lap (t));
+		// as temper_device::init () has it
+		link.report_size = std::min (link.report_size, temper1_report_size);
+		send_cmd (link, cmd_reset0);
+		t = monotonic_ns ();
+		read_data (link, cmd_getdata_inner, buf);
+		st[phase_read].record (lap (t));
+	    } catch (const std::exception& e) {
+		log_line ().field ("device", f.path).field ("op", "bench") << "cannot time: " << e;
+	    }
+	}
+    }
+
+    std::cout << "enumeration over " << opt.count << " runs (ms):\n";
+    bench_report (std::cout, "enumerate", enumeration);
+
+    auto list = usb_device_list (usb);
+    for (const usb_device_found& f: usb_devices_find (list.first.get (), list.second, 0x1130, 0x660c)) {
+	std::cout << "device " << f.path << " (ms):\n";
+	for (int p = 0; p < phases; ++p)
+	    bench_report (std::cout, names[p], steps[f.path][p]);
+
+	try {
+	    usb_transport link (usb_device_open (f.dev));
+	    link.report_size = std::min (link.report_size, temper1_report_size);
+	    send_cmd (link, cmd_reset0);
+	    msg256 buf;
+	    jitter_stats sustained;
+	    int64_t t0 = monotonic_ns (), t = t0;
+	    for (uint64_t i = 0; i < opt.count; ++i) {
+		read_data (link, cmd_getdata_inner, buf);
+		int64_t now = monotonic_ns ();
+		sustained.record (now - std::exchange (t, now));
+	    }
+	    bench_report (std::cout, "back to back", sustained);
+	    std::cout << "  " << opt.count * 1e9 / (t - t0) << " readings/s sustained\n";
+	} catch (const std::exception& e) {
+	    log_line ().field ("device", f.path).field ("op", "bench") << "cannot time: " << e;
+	}
+    }
+}
+
+// On the attached devices, bench_phases (); then, on those or on each
+// number of simulated ones, bench_run () with every model in opt.models.
+int bench (libusb_context* usb, worker_pool& pool, const options& opt) {
+    std::signal (SIGPIPE, SIG_IGN);
+    std::cout << std::fixed << std::setprecision (2);
+    if (opt.simulate.empty ()) {
+	bench_phases (usb, opt);
+	temper_devices devices = temper_devices_open (usb, pool);
+	for (poll_model m: opt.models)
+	    bench_run (usb, nullptr, devices, m, opt);
+	return EXIT_SUCCESS;
+    }
+
+    sim_bus bus {sim_config ()};
+    for (unsigned n: opt.simulate) {
+	temper_devices devices = temper_devices_simulate (bus, pool, n);
+	for (poll_model m: opt.models)
+	    bench_run (nullptr, &bus, devices, m, opt);
+    }
+    return EXIT_SUCCESS;
+}
+
+// The worker pool with --realtime: enough workers for a few devices to be
+// read in parallel, on stacks that are cheap to lock.
+const unsigned realtime_workers = 4;
+const size_t realtime_stack = 256 << 10;
+
+int main (int argc, char* argv[]) try {
+    // from here on, errors never wait for stderr
+    log_thread logging;
+    options opt = parse_options (argc, argv);
+    if (opt.command == "compact")
+	return compact (opt);
+    if (opt.command == "recent")
+	return recent (opt);
+    if (opt.command == "export")
+	return export_history (opt);
+
+    std::unique_ptr<libusb_context, decltype(&libusb_exit)> usb (nullptr, libusb_exit);
+    if (opt.simulate.empty ())
+	usb = usb_open();
+
+    daemon_state state;
+    if (!opt.state.empty ())
+	load_state (opt.state, state);
+    // With --realtime, memory is locked, so a few workers with small
+    // stacks; and only this thread is made real-time, so they start first.
+    worker_pool pool (opt.realtime.enabled ? realtime_workers : 0, opt.realtime.enabled ? realtime_stack : 0);
+    if (opt.realtime.enabled)
+	realtime_enter (opt.realtime);
+    if (opt.command == "bench")
+	return bench (usb.get (), pool, opt);
+
+    sim_bus sim {sim_config ()};
+    temper_devices devices = opt.simulate.empty ()
+	? temper_devices_open (usb.get (), pool, state.devices)
+	: temper_devices_simulate (sim, pool, opt.simulate[0], state.devices);
+
+    if (opt.command == "serve")
+	return serve (usb.get (), opt.simulate.empty () ? nullptr : &sim, devices, state, opt);
+    if (opt.streaming)
+	return stream (devices, opt);
+
+    std::vector<sample> v = temper_devices_read (devices, opt.cal);
+    log_flush ();
+    if (opt.health)
+	temper_devices_health (std::cerr, devices);
+    std::unique_ptr<derived_channels> derived = derived_open (devices, opt);
+    std::vector<sample> extra;
+    sample_output out (STDOUT_FILENO, opt.format, opt.decimals);
+    if (derived) {
+	out.name_channels (derived->names ());
+	derived->apply (v.data (), v.data () + v.size (), extra);
+    }
+    for (const sample& s: v)
+	out.write (s);
+    for (const sample& s: extra)
+	out.write (s);
+    out.flush ();
+    if (!opt.history.dir.empty ())
+	history_writer (opt.history).append (v.data (), v.size ());
+    if (!opt.ring.empty ()) {
+	ring_writer ring (opt.ring, opt.ring_size);
+	for (const sample& s: v)
+	    ring.append (s);
+    }
+
+    // what did read is out, but a device that failed is a failure
+    return v.size () == devices.size () ? EXIT_SUCCESS : EXIT_FAILURE;
 } catch (std::exception& e) {
-    std::cerr << "exception: " << e.what () << std::endl;
+    log_line () << "exception: " << e;
     return EXIT_FAILURE;
 }
 
@@ -0,0 +1,93 @@
+// Bucketing onto the grid, and rows forced out by lag when a column falls
+// behind.
+
+#include <chrono>
+#include <vector>
+
+#include "../align.h"
+#include "check.h"
+
+namespace {
+
+using std::chrono::nanoseconds;
+
+struct row {
+    int64_t time;
+    std::vector<int32_t> values;
+    std::vector<uint8_t> flags;
+};
+
+aligner make (std::vector<aligner::column> cols, align_method m, nanoseconds lag, std::vector<row>& rows) {
+    size_t n = cols.size ();
+    return aligner (std::move (cols), nanoseconds (10), lag, m,
+	[&rows, n] (int64_t t, const int32_t* v, const uint8_t* f) {
+	    rows.push_back (row {t, std::vector<int32_t> (v, v + n), std::vector<uint8_t> (f, f + n)});
+	});
+}
+
+sample at (int64_t time, uint16_t device, int32_t value) {
+    return sample {time, device, channel_inner, 0, value};
+}
+
+} // namespace
+
+int main () {
+    // align_mean: tick t is the mean of (t - 10, t]
+    {
+	std::vector<row> rows;
+	aligner a = make ({{0, channel_inner}}, align_mean, nanoseconds (100), rows);
+	a.push (at (1, 0, 10));
+	a.push (at (5, 0, 20));
+	a.push (at (10, 0, 30));
+	a.push (at (15, 0, 100));
+	a.push (at (31, 0, 50));
+	a.flush ();
+	CHECK (rows.size () == 3);
+	if (rows.size () == 3) {
+	    CHECK (rows[0].time == 10 && rows[0].values[0] == 20 && rows[0].flags[0] == 0);
+	    CHECK (rows[1].time == 20 && rows[1].values[0] == 100 && rows[1].flags[0] == 0);
+	    CHECK (rows[2].time == 30 && rows[2].flags[0] == sample_invalid);
+	}
+    }
+
+    // align_linear: between the readings either side
+    {
+	std::vector<row> rows;
+	aligner a = make ({{0, channel_inner}}, align_linear, nanoseconds (100), rows);
+	a.push (at (5, 0, 0));
+	a.push (at (25, 0, 200));
+	CHECK (rows.size () == 2);
+	if (rows.size () == 2) {
+	    CHECK (rows[0].time == 10 && rows[0].values[0] == 50);
+	    CHECK (rows[1].time == 20 && rows[1].values[0] == 150);
+	}
+    }
+
+    // align_last with a second column that lags: its ticks go out invalid
+    // once they are 20 behind, and it catches up from the next one
+    {
+	std::vector<row> rows;
+	aligner a = make ({{0, channel_inner}, {1, channel_inner}}, align_last, nanoseconds (20), rows);
+	a.push (at (10, 0, 1));
+	CHECK (rows.empty ());
+	a.push (at (40, 0, 4));
+	CHECK (rows.size () == 2);
+	a.push (at (35, 1, 7));
+	a.push (at (33, 1, 6));         // older than the last: ignored
+	a.flush ();
+	CHECK (rows.size () == 4);
+	if (rows.size () == 4) {
+	    for (int i = 0; i < 3; ++i) {
+		CHECK (rows[i].time == 10 * (i + 1));
+		CHECK (rows[i].values[0] == 1 && rows[i].flags[0] == 0);
+		CHECK (rows[i].flags[1] == sample_invalid);
+	    }
+	    CHECK (rows[3].time == 40);
+	    CHECK (rows[3].values[0] == 4 && rows[3].values[1] == 7);
+	    CHECK (rows[3].flags[0] == 0 && rows[3].flags[1] == 0);
+	}
+    }
+    return check_status ();
+}
+
+// vim: ts=8 sts=4 sw=4 et
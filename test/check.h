@@ -0,0 +1,23 @@
+#ifndef TEMPER_TEST_CHECK_H
+#define TEMPER_TEST_CHECK_H
+
+// A minimal harness for the tests run by make check: CHECK () reports a
+// failed condition and carries on, and check_status () is what main
+// returns.
+
+#include <cstdio>
+#include <cstdlib>
+
+inline int check_failures = 0;
+
+#define CHECK(cond) \
+    ((cond) ? (void) 0 : (std::fprintf (stderr, "%s:%d: CHECK (%s) failed\n", __FILE__, __LINE__, #cond), \
+	(void) ++check_failures))
+
+inline int check_status () {
+    return check_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
+
+// vim: ts=8 sts=4 sw=4 et
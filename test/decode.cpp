@@ -0,0 +1,82 @@
+// The vector kernels must agree bit for bit with the scalar one, at every
+// length and alignment, including the flags.
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../decode.h"
+#include "../sample.h"
+#include "check.h"
+
+namespace {
+
+const calibration cal {1.02f, -0.5f};
+
+template <typename T>
+void check_temper (const std::vector<uint8_t>& raw, size_t n) {
+    std::vector<T> want (n), got (n);
+    std::vector<uint8_t> want_flags (n), got_flags (n);
+    decode_use (decode_scalar);
+    decode_temper (raw.data (), n, cal, want.data (), want_flags.data ());
+    for (int k = decode_sse2; k <= decode_best (); ++k) {
+	decode_use (decode_kernel (k));
+	decode_temper (raw.data (), n, cal, got.data (), got_flags.data ());
+	CHECK (std::memcmp (want.data (), got.data (), n * sizeof (T)) == 0);
+	CHECK (want_flags == got_flags);
+    }
+}
+
+void check_sht1x (const std::vector<uint16_t>& temp, const std::vector<uint16_t>& humidity, size_t n) {
+    std::vector<int32_t> want_t (n), want_h (n), got_t (n), got_h (n);
+    std::vector<uint8_t> want_flags (n), got_flags (n);
+    decode_use (decode_scalar);
+    decode_sht1x (temp.data (), humidity.data (), n, cal, cal, want_t.data (), want_h.data (), want_flags.data ());
+    for (int k = decode_sse2; k <= decode_best (); ++k) {
+	decode_use (decode_kernel (k));
+	decode_sht1x (temp.data (), humidity.data (), n, cal, cal, got_t.data (), got_h.data (), got_flags.data ());
+	CHECK (want_t == got_t);
+	CHECK (want_h == got_h);
+	CHECK (want_flags == got_flags);
+    }
+}
+
+} // namespace
+
+int main () {
+    std::mt19937 rng (1);
+    std::vector<uint8_t> raw (2 * 100);
+    for (uint8_t& b: raw)
+	b = rng ();
+    // the edges of the sensor's range and the bus-idle pattern
+    const uint8_t edges[] = {0x7d, 0x00, 0x7d, 0x01, 0xc9, 0x00, 0xc8, 0xff, 0xff, 0xff, 0x00, 0x00};
+    std::memcpy (raw.data (), edges, sizeof edges);
+    for (size_t n = 0; n <= 100; ++n) {
+	check_temper<float> (raw, n);
+	check_temper<int32_t> (raw, n);
+    }
+
+    std::vector<uint16_t> temp (100), humidity (100);
+    for (size_t i = 0; i < temp.size (); ++i) {
+	temp[i] = rng () & 0x3fff;
+	humidity[i] = rng () & 0xfff;
+    }
+    temp[0] = 0xffff;
+    humidity[1] = 0xffff;
+    humidity[2] = 0;
+    for (size_t n = 0; n <= 100; ++n)
+	check_sht1x (temp, humidity, n);
+
+    // and the scalar kernel must be right
+    const uint8_t known[] = {0x19, 0x80, 0xff, 0xff};
+    int32_t v[2];
+    uint8_t flags[2];
+    decode_use (decode_scalar);
+    decode_temper (known, 2, calibration (), v, flags);
+    CHECK (v[0] == 25500 && flags[0] == 0);
+    CHECK (flags[1] == sample_invalid);
+    return check_status ();
+}
+
+// vim: ts=8 sts=4 sw=4 et
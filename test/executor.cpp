@@ -0,0 +1,87 @@
+// Every task posted runs exactly once, wherever it is posted from, with
+// workers parking and waking all the while; and a strand runs its tasks
+// one at a time, in order.
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../executor.h"
+#include "check.h"
+
+namespace {
+
+// Bursts from outside the pool, with pauses long enough for the workers
+// to park, and each task posting another from inside.
+void check_pool (unsigned threads) {
+    const int bursts = 200, per_burst = 50;
+    std::atomic<int> ran {0}, nested {0};
+    {
+	worker_pool pool (threads);
+	for (int b = 0; b < bursts; ++b) {
+	    for (int i = 0; i < per_burst; ++i)
+		pool.post ([&pool, &ran, &nested] {
+		    ++ran;
+		    pool.post ([&nested] { ++nested; });
+		});
+	    if (b % 10 == 0)
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+    }
+    CHECK (ran == bursts * per_burst);
+    CHECK (nested == bursts * per_burst);
+}
+
+// A lone task after the workers have all parked still runs.
+void check_wakeup () {
+    worker_pool pool (4);
+    for (int i = 0; i < 100; ++i) {
+	std::atomic<bool> done {false};
+	pool.post ([&done] { done = true; done.notify_one (); });
+	done.wait (false);
+	if (i % 25 == 0)
+	    std::this_thread::sleep_for (std::chrono::milliseconds (2));
+    }
+}
+
+void check_strands () {
+    const int strands = 8, tasks = 2000;
+    std::vector<std::vector<int>> order (strands);
+    std::vector<std::atomic<int>> inside (strands);
+    std::atomic<bool> overlapped {false};
+    {
+	worker_pool pool (4);
+	std::vector<std::unique_ptr<strand>> s;
+	for (int k = 0; k < strands; ++k)
+	    s.emplace_back (new strand (pool));
+	for (int i = 0; i < tasks; ++i)
+	    for (int k = 0; k < strands; ++k)
+		s[k]->post ([&, k, i] {
+		    if (inside[k]++)
+			overlapped = true;
+		    order[k].push_back (i);
+		    --inside[k];
+		});
+    }
+    CHECK (!overlapped);
+    for (int k = 0; k < strands; ++k) {
+	bool in_order = int (order[k].size ()) == tasks;
+	for (int i = 0; in_order && i < tasks; ++i)
+	    in_order = order[k][i] == i;
+	CHECK (in_order);
+    }
+}
+
+} // namespace
+
+int main () {
+    for (unsigned threads: {1u, 2u, 4u, 8u})
+	check_pool (threads);
+    check_wakeup ();
+    check_strands ();
+    return check_status ();
+}
+
+// vim: ts=8 sts=4 sw=4 et
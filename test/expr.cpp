@@ -0,0 +1,80 @@
+// Derived channels: a missing or invalid input makes the result invalid,
+// whatever the operator.
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../expr.h"
+#include "check.h"
+
+namespace {
+
+sample at (uint16_t device, uint8_t channel, int32_t value, uint8_t flags = 0) {
+    return sample {1000, device, channel, flags, value};
+}
+
+// Computes text for device 0 of devices 0 and 1 from the readings in.
+sample derive (const std::string& text, const std::vector<sample>& in) {
+    derived_channels d ({parse_derived_spec ("0:x=" + text)}, {0, 1});
+    std::vector<sample> out;
+    d.apply (in.data (), in.data () + in.size (), out);
+    CHECK (out.size () == 1);
+    return out.empty () ? sample {} : out[0];
+}
+
+bool invalid (const sample& s) {
+    return s.flags & sample_invalid;
+}
+
+} // namespace
+
+int main () {
+    const std::vector<sample> both = {at (0, channel_inner, 20000), at (1, channel_inner, 25500)};
+    CHECK (derive ("max(inner[0],inner[1])", both).value == 25500);
+    CHECK (derive ("min(inner,inner[1])", both).value == 20000);
+    CHECK (derive ("(inner[1]-inner)^2", both).value == 30250);
+    CHECK (derive ("inner[1]^0", both).value == 1000);
+    for (const char* e: {"max(inner[0],inner[1])", "min(inner,inner[1])", "(inner[1]-inner)^2"})
+	CHECK (!invalid (derive (e, both)));
+
+    // device 1 missing, then present but invalid
+    const std::vector<std::vector<sample>> broken = {
+	{at (0, channel_inner, 20000)},
+	{at (0, channel_inner, 20000), at (1, channel_inner, 0, sample_invalid)}
+    };
+    for (const std::vector<sample>& in: broken) {
+	for (const char* e: {"max(inner[0],inner[1])", "min(inner[1],inner)", "inner[1]^0", "1^inner[1]",
+		"inner+inner[1]", "abs(inner[1])", "0*inner[1]", "inner[1]-inner[1]"}) {
+	    sample s = derive (e, in);
+	    CHECK (invalid (s));
+	    if (!invalid (s))
+		std::fprintf (stderr, "  %s gave %d\n", e, s.value);
+	}
+    }
+
+    // nothing else of the device is needed
+    CHECK (!invalid (derive ("inner*2", broken[0])));
+    CHECK (derive ("inner*2", broken[0]).value == 40000);
+
+    // and humidity counts as missing when it is the one absent
+    CHECK (invalid (derive ("max(inner,humidity)", both)));
+
+    // nesting is bounded while parsing, not only the stack when evaluating
+    CHECK (derive (std::string (60, '(') + "inner" + std::string (60, ')'), both).value == 20000);
+    CHECK (derive (std::string (60, '-') + "inner", both).value == 20000);
+    for (const std::string& e: {std::string (100000, '(') + "1", std::string (100000, '-') + "1",
+	    std::string (100, '(') + "1" + std::string (100, ')')}) {
+	bool threw = false;
+	try {
+	    derived_channels d ({parse_derived_spec ("0:x=" + e)}, {0, 1});
+	} catch (const std::runtime_error&) {
+	    threw = true;
+	}
+	CHECK (threw);
+    }
+    return check_status ();
+}
+
+// vim: ts=8 sts=4 sw=4 et
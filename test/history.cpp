@@ -0,0 +1,284 @@
+// Compaction: merging small segments, rolling old data up into per-bucket
+// aggregates, expiring it, and finishing a replacement that a crash
+// interrupted.
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../history.h"
+#include "check.h"
+
+namespace {
+
+const int64_t second = 1000000000;
+const int64_t minute = 60 * second;
+const int64_t hour = 60 * minute;
+
+std::string scratch () {
+    char dir[] = "/tmp/temper-history-XXXXXX";
+    if (!mkdtemp (dir))
+	std::abort ();
+    return dir;
+}
+
+void remove_all (const std::string& dir) {
+    std::string cmd = "rm -rf '" + dir + "'";
+    if (std::system (cmd.c_str ()) != 0)
+	std::abort ();
+}
+
+sample numbered (int64_t time, int32_t value, uint16_t device = 0, uint8_t flags = 0) {
+    return sample {time, device, channel_inner, flags, value};
+}
+
+// Raw segments of n samples each, so every n appends start a new one.
+history_config small_segments (const std::string& dir, size_t n) {
+    history_config cfg;
+    cfg.dir = dir;
+    cfg.segment_bytes = sizeof (segment_header) + n * sizeof (sample);
+    return cfg;
+}
+
+// Compaction as fast as it goes, and nothing merged unless asked for.
+history_config compaction (const std::string& dir) {
+    history_config cfg;
+    cfg.dir = dir;
+    cfg.rate = 0;
+    cfg.merge_below = 0;
+    return cfg;
+}
+
+template <typename T>
+std::vector<T> contents (const segment_info& s) {
+    unique_fd fd (::open (s.path.c_str (), O_RDONLY | O_CLOEXEC));
+    std::vector<T> out (s.records ());
+    out.resize (read_records (fd.get (), s, 0, out.data (), out.size ()));
+    return out;
+}
+
+bool run_of (const std::vector<sample>& v, int64_t first_time) {
+    for (size_t i = 0; i < v.size (); ++i)
+	if (v[i].time != first_time + int64_t (i) || v[i].value != int32_t (first_time + i))
+	    return false;
+    return true;
+}
+
+std::string name_of (const segment_info& s) {
+    return s.path.substr (s.path.rfind ('/') + 1);
+}
+
+bool exists (const std::string& path) {
+    return ::access (path.c_str (), F_OK) == 0;
+}
+
+void write_file (const std::string& path, const void* p, size_t n) {
+    unique_fd fd (posix_check (::open (path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666), path));
+    write_all (fd.get (), p, n, path);
+}
+
+void check_merge () {
+    std::string dir = scratch ();
+    {
+	history_writer w (small_segments (dir, 4));
+	for (int64_t t = 1000; t < 1020; ++t)
+	    w.append (numbered (t, t));
+    }
+    CHECK (list_segments (dir).size () == 5);
+
+    // all but the newest, which is still being appended to
+    history_config cfg = compaction (dir);
+    cfg.merge_below = 64 << 10;
+    compaction_stats st = compactor (cfg).run_once ();
+    CHECK (st.merged == 4);
+
+    auto segs = list_segments (dir);
+    CHECK (segs.size () == 2);
+    if (segs.size () == 2) {
+	CHECK (segs[0].header.compacted && segs[0].first_time == 1000 && segs[0].last_time == 1015);
+	auto merged = contents<sample> (segs[0]);
+	CHECK (merged.size () == 16 && run_of (merged, 1000));
+	CHECK (!segs[1].header.compacted && run_of (contents<sample> (segs[1]), 1016));
+    }
+
+    // and a second pass finds nothing more to do
+    st = compactor (cfg).run_once ();
+    CHECK (st.merged == 0);
+    remove_all (dir);
+}
+
+void check_rollup () {
+    std::string dir = scratch ();
+    int64_t t0 = (now_ns () - 2 * hour) / minute * minute;
+    {
+	history_writer w (small_segments (dir, 6));
+	w.append (numbered (t0 + 1 * second, 10));
+	w.append (numbered (t0 + 2 * second, 30));
+	w.append (numbered (t0 + 3 * second, 20));
+	w.append (numbered (t0 + 4 * second, 999, 0, sample_invalid));
+	w.append (numbered (t0 + 5 * second, 7, 1));
+	w.append (numbered (t0 + minute + 5 * second, -4));
+	w.append (numbered (now_ns (), 1));
+    }
+
+    history_config cfg = compaction (dir);
+    cfg.rollup_after = std::chrono::hours (1);
+    cfg.rollup_width = std::chrono::minutes (1);
+    compaction_stats st = compactor (cfg).run_once ();
+    CHECK (st.rolled_up == 1);
+
+    auto segs = list_segments (dir);
+    CHECK (segs.size () == 2);
+    if (segs.size () == 2) {
+	CHECK (segs[0].kind == segment_rollup && segs[0].header.rollup_width == minute);
+	CHECK (segs[0].first_time == t0 + second && segs[0].last_time == t0 + minute + 5 * second);
+	CHECK (segs[1].kind == segment_raw);
+	auto r = contents<rollup> (segs[0]);
+	CHECK (r.size () == 3);
+	if (r.size () == 3) {
+	    // an invalid reading flags its bucket but is not counted
+	    CHECK (r[0].start == t0 && r[0].device == 0 && r[0].flags == sample_invalid);
+	    CHECK (r[0].count == 3 && r[0].min == 10 && r[0].max == 30 && r[0].sum == 60);
+	    CHECK (r[1].start == t0 && r[1].device == 1 && r[1].flags == 0);
+	    CHECK (r[1].count == 1 && r[1].min == 7 && r[1].max == 7 && r[1].sum == 7);
+	    CHECK (r[2].start == t0 + minute && r[2].count == 1 && r[2].sum == -4);
+	}
+    }
+    remove_all (dir);
+}
+
+void check_retention () {
+    std::string dir = scratch ();
+    int64_t t = now_ns ();
+    {
+	history_writer w (small_segments (dir, 2));
+	w.append (numbered (t - 3 * hour, 1));
+	w.append (numbered (t - 2 * hour, 2));
+	w.append (numbered (t - 2 * hour, 3));
+	w.append (numbered (t - 30 * minute, 4));
+	w.append (numbered (t, 5));
+    }
+    CHECK (list_segments (dir).size () == 3);
+
+    // a segment goes once its newest reading has
+    history_config cfg = compaction (dir);
+    cfg.retention = std::chrono::hours (1);
+    compaction_stats st = compactor (cfg).run_once ();
+    CHECK (st.expired == 1);
+    auto segs = list_segments (dir);
+    CHECK (segs.size () == 2);
+    if (segs.size () == 2) {
+	CHECK (segs[0].first_time == t - 2 * hour && segs[0].last_time == t - 30 * minute);
+	CHECK (segs[1].first_time == t);
+    }
+
+    // the newest is kept however old it is
+    st = compactor (cfg).run_once ();
+    CHECK (st.expired == 0);
+    remove_all (dir);
+}
+
+// Three segments of 4 and the merged first two, as compaction would have
+// written them to compact.tmp.
+struct crashed {
+    std::string dir;
+    std::vector<segment_info> segs;
+    std::vector<char> merged;
+
+    crashed (): dir (scratch ()) {
+	{
+	    history_writer w (small_segments (dir, 4));
+	    for (int64_t t = 1000; t < 1012; ++t)
+		w.append (numbered (t, t));
+	}
+	segs = list_segments (dir);
+	CHECK (segs.size () == 3);
+
+	segment_header h = segs[0].header;
+	h.compacted = 1;
+	h.first_time = 1000;
+	h.last_time = 1007;
+	merged.assign (reinterpret_cast<const char*> (&h), reinterpret_cast<const char*> (&h + 1));
+	for (int64_t t = 1000; t < 1008; ++t) {
+	    sample s = numbered (t, t);
+	    merged.insert (merged.end (), reinterpret_cast<const char*> (&s), reinterpret_cast<const char*> (&s + 1));
+	}
+    }
+
+    ~crashed () {
+	remove_all (dir);
+    }
+
+    void intent () {
+	std::string text = name_of (segs[0]) + '\n' + name_of (segs[0]) + '\n' + name_of (segs[1]) + '\n';
+	write_file (dir + "/compact.intent", text.data (), text.size ());
+    }
+
+    void tmp () {
+	write_file (dir + "/compact.tmp", merged.data (), merged.size ());
+    }
+
+    // Recovery then no further compaction.
+    void recover () {
+	compaction_stats st = compactor (compaction (dir)).run_once ();
+	CHECK (st.merged == 0 && st.rolled_up == 0 && st.expired == 0);
+	CHECK (!exists (dir + "/compact.tmp") && !exists (dir + "/compact.intent"));
+    }
+
+    // Whether the first two segments were replaced by the merged one.
+    bool rolled_forward () {
+	auto left = list_segments (dir);
+	return left.size () == 2 && left[0].path == segs[0].path && left[0].header.compacted
+	    && contents<sample> (left[0]).size () == 8 && run_of (contents<sample> (left[0]), 1000)
+	    && left[1].path == segs[2].path;
+    }
+};
+
+void check_recovery () {
+    // crashed with the intent on disk, before the rename
+    {
+	crashed c;
+	c.tmp ();
+	c.intent ();
+	c.recover ();
+	CHECK (c.rolled_forward ());
+    }
+
+    // after the rename, part way through deleting the sources
+    {
+	crashed c;
+	c.tmp ();
+	CHECK (::rename ((c.dir + "/compact.tmp").c_str (), c.segs[0].path.c_str ()) == 0);
+	c.intent ();
+	c.recover ();
+	CHECK (c.rolled_forward ());
+    }
+
+    // before the intent: the sources stand and the new segment goes
+    {
+	crashed c;
+	c.tmp ();
+	c.recover ();
+	auto segs = list_segments (c.dir);
+	CHECK (segs.size () == 3);
+	for (size_t i = 0; i < segs.size (); ++i)
+	    CHECK (!segs[i].header.compacted && run_of (contents<sample> (segs[i]), 1000 + 4 * i));
+    }
+}
+
+} // namespace
+
+int main () {
+    check_merge ();
+    check_rollup ();
+    check_retention ();
+    check_recovery ();
+    return check_status ();
+}
+
+// vim: ts=8 sts=4 sw=4 et
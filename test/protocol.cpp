@@ -0,0 +1,49 @@
+// Report sizes from HID report descriptors.
+
+#include <initializer_list>
+
+#include "../protocol.h"
+#include "check.h"
+
+namespace {
+
+size_t size_of (std::initializer_list<unsigned char> d) {
+    return hid_report_size (std::span<const unsigned char> (d.begin (), d.size ()));
+}
+
+} // namespace
+
+int main () {
+    // as a TEMPer sends it: 8-byte input and output reports
+    CHECK (size_of ({
+	0x06, 0x00, 0xff,               // Usage Page (vendor)
+	0x09, 0x01,                     // Usage
+	0xa1, 0x01,                     // Collection (application)
+	0x15, 0x00,                     // Logical Minimum
+	0x26, 0xff, 0x00,               // Logical Maximum
+	0x75, 0x08,                     // Report Size (8)
+	0x95, 0x08,                     // Report Count (8)
+	0x09, 0x01, 0x81, 0x02,         // Input
+	0x95, 0x08,
+	0x09, 0x01, 0x91, 0x02,         // Output
+	0xc0                            // End Collection
+    }) == 8);
+
+    // the larger of input and feature, with the fields of each summed
+    CHECK (size_of ({0x75, 0x08, 0x95, 0x04, 0x81, 0x02, 0x95, 0x04, 0x81, 0x02,
+	0x95, 0x20, 0xb1, 0x02}) == 32);
+    CHECK (size_of ({0x75, 0x08, 0x95, 0x10, 0x81, 0x02, 0x95, 0x02, 0xb1, 0x02}) == 16);
+
+    // bits round up to bytes; four-byte data is little-endian
+    CHECK (size_of ({0x75, 0x01, 0x95, 0x03, 0x81, 0x02}) == 1);
+    CHECK (size_of ({0x77, 0x08, 0x00, 0x00, 0x00, 0x97, 0x02, 0x01, 0x00, 0x00, 0x81, 0x02}) == 258);
+
+    // numbered reports, long items, truncation and nothing at all
+    CHECK (size_of ({0x85, 0x01, 0x75, 0x08, 0x95, 0x08, 0x81, 0x02}) == 0);
+    CHECK (size_of ({0xfe, 0x00, 0x00}) == 0);
+    CHECK (size_of ({0x75, 0x08, 0x96, 0x08}) == 0);
+    CHECK (size_of ({}) == 0);
+    return check_status ();
+}
+
+// vim: ts=8 sts=4 sw=4 et
@@ -0,0 +1,75 @@
+// Wraparound, and a writer reopening a ring where the last one stopped.
+
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+#include "../ring.h"
+#include "check.h"
+
+namespace {
+
+sample numbered (int64_t i) {
+    return sample {i, uint16_t (i % 3), channel_inner, 0, int32_t (i * 1000)};
+}
+
+// Whether out[0..n) are samples first, first + 1, ...
+bool run_of (const sample* out, size_t n, int64_t first) {
+    for (size_t i = 0; i < n; ++i) {
+	sample want = numbered (first + i);
+	if (out[i].time != want.time || out[i].device != want.device || out[i].value != want.value)
+	    return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main () {
+    char dir[] = "/tmp/temper-ring-XXXXXX";
+    if (!mkdtemp (dir))
+	return EXIT_FAILURE;
+    std::string path = std::string (dir) + "/ring";
+    sample out[16];
+
+    {
+	ring_writer w (path, 5);
+	ring_reader r (path);
+	CHECK (r.capacity () == 5);
+	CHECK (r.recent (out, 16) == 0);
+
+	for (int64_t i = 0; i < 3; ++i)
+	    w.append (numbered (i));
+	CHECK (r.recent (out, 16) == 3 && run_of (out, 3, 0));
+
+	// twice round and a bit: only the last capacity are left
+	for (int64_t i = 3; i < 12; ++i)
+	    w.append (numbered (i));
+	CHECK (r.recent (out, 16) == 5 && run_of (out, 5, 7));
+	CHECK (r.recent (out, 2) == 2 && run_of (out, 2, 10));
+    }
+
+    // a restarted writer carries on from the same head
+    {
+	ring_writer w (path, 5);
+	w.append (numbered (12));
+	ring_reader r (path);
+	CHECK (r.recent (out, 16) == 5 && run_of (out, 5, 8));
+    }
+
+    // one of another capacity starts afresh
+    {
+	ring_writer w (path, 8);
+	ring_reader r (path);
+	CHECK (r.capacity () == 8);
+	CHECK (r.recent (out, 16) == 0);
+	w.append (numbered (0));
+	CHECK (r.recent (out, 16) == 1 && run_of (out, 1, 0));
+    }
+
+    unlink (path.c_str ());
+    rmdir (dir);
+    return check_status ();
+}
+
+// vim: ts=8 sts=4 sw=4 et